@@ -24,8 +24,82 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
 #include "sma.h"
 
+#define THREAD_COUNT 4
+#define THREAD_ROUNDS 20000
+
+int constructed = 0, destructed = 0;
+int corrupted[THREAD_COUNT];
+pthread_key_t lateKey;
+
+void construct_object(void *object)
+{
+	*(int *)object = 42;
+	constructed++;
+}
+
+void destruct_object(void *object)
+{
+	destructed++;
+}
+
+// Churns 16 blocks filled with the index of the thread, which another thread writing into them would change
+void *churn_blocks(void *arg)
+{
+	int id = *(int *)arg, i, j;
+	unsigned int seed = id + 1;
+	char *blocks[16] = {NULL};
+	size_t sizes[16] = {0}, size, k;
+
+	for (i = 0; i < THREAD_ROUNDS; i++)
+	{
+		j = rand_r(&seed) % 16;
+		size = rand_r(&seed) % 2048 + 1;
+		for (k = 0; blocks[j] != NULL && k < sizes[j]; k++)
+			if (blocks[j][k] != id)
+				corrupted[id]++;
+
+		if (blocks[j] == NULL)
+			blocks[j] = (char *)sma_malloc(size);
+		else if (rand_r(&seed) % 2 == 0)
+		{
+			sma_free(blocks[j]);
+			blocks[j] = NULL;
+		}
+		else
+			blocks[j] = (char *)sma_realloc(blocks[j], size);
+
+		sizes[j] = blocks[j] != NULL ? size : 0;
+		memset(blocks[j], id, sizes[j]);
+	}
+	for (j = 0; j < 16; j++)
+		if (blocks[j] != NULL)
+			sma_free(blocks[j]);
+
+	return NULL;
+}
+
+// A TLS destructor that runs after the one of the thread cache, its frees land in the cache again
+void free_late_blocks(void *blocks)
+{
+	for (int i = 0; i < 8; i++)
+		sma_free(((void **)blocks)[i]);
+}
+
+void *leave_late_blocks(void *arg)
+{
+	void **blocks = (void **)arg;
+
+	for (int i = 0; i < 8; i++)
+		blocks[i] = sma_malloc(64);
+	pthread_setspecific(lateKey, blocks);
+
+	return NULL;
+}
+
 int main(int argc, char *argv[])
 {
 	int i, count = 0;
@@ -199,5 +273,799 @@ int main(int argc, char *argv[])
 	sma_mallinfo();
 	debug();
 
+	// Test 7: Segregated Fit Test
+	puts("Test 7: Check for Segregated Fit algorithm...");
+	// Sets Policy to Segregated Fit
+	sma_mallopt(SEGREGATED_FIT);
+
+	char *small[64];
+	for (i = 0; i < 64; i++) {
+		small[i] = (char *)sma_malloc(48);
+	}
+
+	// Objects of one size class are packed back to back without boundary tags
+	count = 0;
+	for (i = 1; i < 64; i++) {
+		if (small[i] == small[i - 1] + 48)
+			count++;
+	}
+
+	// A freed object is handed out again to the next request of its size class
+	sma_free(small[20]);
+	ct = (char *)sma_malloc(40);
+
+	// The smallest size class doesn't pay for the links of a free list block
+	for (i = 0; i < 32; i++)
+		c[i] = (char *)sma_malloc(16);
+	for (i = 1; i < 32; i++)
+		if (c[i] != c[i - 1] + 16 || sma_usable_size(c[i]) != 16)
+			count++;
+	for (i = 0; i < 32; i++)
+		sma_free(c[i]);
+
+	if (count == 63 && ct == small[20])
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	for (i = 0; i < 64; i++) {
+		sma_free(small[i]);
+	}
+	sma_mallopt(WORST_FIT);
+
+	// Test 8: Mapped Large Block Test
+	puts("Test 8: Check for large blocks mapped on their own...");
+
+	count = 0;
+	limitbefore = sbrk(0);
+	ptr = sma_malloc(1024 * 1024);
+	limitafter = sbrk(0);
+
+	// The program break stays where it is for blocks above the mmap threshold
+	if (ptr == NULL || limitafter != limitbefore || (ptr >= limitbefore && ptr <= limitafter))
+		count++;
+	else
+	{
+		memset(ptr, 1, 1024 * 1024);
+		sma_free(ptr);
+	}
+
+	// A threshold above 2 GB is taken as a size_t, the block then comes from under the break
+	sma_mallopt(MMAP_THRESHOLD, (size_t)4 * 1024 * 1024 * 1024);
+	ptr = sma_malloc(1024 * 1024);
+	if (ptr == NULL || ptr >= sbrk(0))
+		count++;
+	sma_free(ptr);
+	sma_mallopt(MMAP_THRESHOLD, (size_t)128 * 1024);
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 9: In-place Realloc Test
+	puts("Test 9: Check for Reallocation in place...");
+
+	ct = (char *)sma_malloc(1024);
+	*ct = 'a';
+
+	// A growing buffer absorbs the free space that follows it instead of moving
+	count = 0;
+	for (i = 2; i <= 64; i++)
+	{
+		ptr = sma_realloc(ct, 1024 * i);
+		if (ptr != ct)
+			count++;
+		ct = (char *)ptr;
+	}
+
+	if (count == 0 && *ct == 'a')
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	sma_free(ct);
+
+	// Test 10: Alignment and 64-bit Size Test
+	puts("Test 10: Check for aligned payloads and blocks above 2 GB...");
+
+	// Every payload is 16-byte aligned, whatever the size asked for
+	count = 0;
+	for (i = 1; i <= 32; i++)
+	{
+		c[i - 1] = (char *)sma_malloc(i * 37);
+		if ((unsigned long)c[i - 1] % 16 != 0)
+			count++;
+	}
+	for (i = 0; i < 32; i++)
+	{
+		sma_free(c[i]);
+	}
+
+	// A size that doesn't fit in an int keeps all of its bytes
+	size_t hugeSize = 3UL * 1024 * 1024 * 1024;
+	ct = (char *)sma_malloc(hugeSize);
+
+	if (count == 0 && ct != NULL && (unsigned long)ct % 16 == 0)
+	{
+		ct[0] = 'a';
+		ct[hugeSize - 1] = 'z';
+		if (ct[0] == 'a' && ct[hugeSize - 1] == 'z')
+			puts("\t\t\t\t PASSED\n");
+		else
+			puts("\t\t\t\t FAILED\n");
+		sma_free(ct);
+	}
+	else
+	{
+		puts("\t\t\t\t FAILED\n");
+	}
+
+	// Test 11: Statistics Test
+	puts("Test 11: Check for heap statistics...");
+
+	SmaStats before = sma_stats();
+	ptr = sma_malloc(4000);
+	SmaStats during = sma_stats();
+	sma_free(ptr);
+	SmaStats after = sma_stats();
+
+	// The free blocks of the histogram are the ones counted, and the block is back in the free list
+	size_t histogramCount = 0;
+	for (i = 0; i < SMA_FREE_HISTOGRAM_BINS; i++)
+	{
+		histogramCount += after.freeBlockHistogram[i];
+	}
+
+	if (during.bytesInUse - before.bytesInUse == 4000 && after.bytesInUse == before.bytesInUse &&
+		histogramCount == after.freeBlockCount && after.largestFreeBlock <= after.freeBytes &&
+		after.heapGrownBytes - after.heapShrunkBytes > after.freeBytes)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 12: Aligned Allocation Test
+	puts("Test 12: Check for aligned allocation...");
+
+	before = sma_stats();
+	count = 0;
+	for (i = 6; i <= 12; i++)
+	{
+		c[i] = (char *)sma_memalign(1UL << i, 1000);
+		if (c[i] == NULL || (unsigned long)c[i] % (1UL << i) != 0 || sma_usable_size(c[i]) < 1000)
+			count++;
+	}
+	for (i = 6; i <= 12; i++)
+	{
+		sma_free(c[i]);
+	}
+	after = sma_stats();
+
+	// The slack around the aligned payloads went back to the free list along with the blocks
+	if (count == 0 && after.bytesInUse == before.bytesInUse)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 13: Arena Test
+	puts("Test 13: Check for arena allocation and reset...");
+
+	before = sma_stats();
+	Arena *arena = sma_arena_create(4 * 1024);
+
+	// Objects are packed back to back without headers, a chunk after another
+	count = 0;
+	int packed = 0;
+	char *first = (char *)sma_arena_alloc(arena, 40);
+	ct = first;
+	for (i = 1; i < 1000; i++)
+	{
+		ptr = sma_arena_alloc(arena, 40);
+		if (ptr == NULL || (unsigned long)ptr % 16 != 0)
+			count++;
+		else if (ptr == ct + 48)
+			packed++;
+		ct = (char *)ptr;
+	}
+
+	// A reset hands out the chunks again from the first object on
+	sma_arena_reset(arena);
+	ct = (char *)sma_arena_alloc(arena, 40);
+	during = sma_stats();
+	sma_arena_destroy(arena);
+	after = sma_stats();
+
+	if (count == 0 && packed > 950 && ct == first && during.bytesInUse > before.bytesInUse + 1000 * 48 &&
+		after.bytesInUse == before.bytesInUse)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 14: Object Cache Test
+	puts("Test 14: Check for object caches keeping constructed state...");
+
+	ObjectCache *cache = sma_cache_create("test", 100, construct_object, destruct_object);
+	int *objects[100];
+	count = 0;
+	for (i = 0; i < 100; i++)
+	{
+		objects[i] = (int *)sma_cache_alloc(cache);
+		if (objects[i] == NULL || *objects[i] != 42 || (unsigned long)objects[i] % 16 != 0)
+			count++;
+	}
+
+	// A freed object comes back as it was left, without running the constructor again
+	int constructedBefore = constructed;
+	*objects[50] = 7;
+	sma_cache_free(cache, objects[50]);
+	objects[50] = (int *)sma_cache_alloc(cache);
+
+	// An object given to another cache is refused and stays handed out
+	ObjectCache *otherCache = sma_cache_create("other", 100, NULL, NULL);
+	sma_cache_free(otherCache, objects[10]);
+	sma_cache_destroy(otherCache);
+	ObjectCacheStats cacheStats = sma_cache_stats(cache);
+
+	if (*objects[50] != 7 || constructed != constructedBefore || cacheStats.objectsInUse != 100 ||
+		cacheStats.hits + cacheStats.misses != 101 || cacheStats.misses != cacheStats.slabCount)
+		count++;
+
+	for (i = 0; i < 100; i++)
+		sma_free(objects[i]);
+	sma_cache_destroy(cache);
+
+	if (count == 0 && constructed == destructed)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 15: TLSF Test
+	puts("Test 15: Check for Two-Level Segregated Fit algorithm...");
+	// Sets Policy to TLSF
+	sma_mallopt(TLSF_FIT);
+
+	// A hole of 5000 bytes kept apart from the rest of the free space
+	char *hole = (char *)sma_malloc(5000);
+	char *spacer = (char *)sma_malloc(64);
+	sma_free(hole);
+	before = sma_stats();
+
+	// The request is served from the smallest size class that fits, so the largest block stays whole
+	ct = (char *)sma_malloc(2900);
+	during = sma_stats();
+	sma_free(ct);
+	sma_free(spacer);
+	after = sma_stats();
+
+	// Back to worst fit, the free heap is rebuilt from the free list
+	sma_mallopt(WORST_FIT);
+	SmaStats rebuilt = sma_stats();
+
+	if (ct != NULL && during.largestFreeBlock == before.largestFreeBlock &&
+		during.freeBytes < before.freeBytes && rebuilt.largestFreeBlock == after.largestFreeBlock)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 16: Batch Test
+	puts("Test 16: Check for batch allocation and free...");
+
+	before = sma_stats();
+	void *batch[100];
+	count = 0;
+	if (sma_malloc_batch(200, 100, batch) != 100)
+		count++;
+
+	// The blocks are carved back to back out of one free region
+	for (i = 0; i < 100; i++)
+	{
+		if ((unsigned long)batch[i] % 16 != 0 || sma_usable_size(batch[i]) < 200)
+			count++;
+		else if (i > 0 && (char *)batch[i] <= (char *)batch[i - 1])
+			count++;
+		memset(batch[i], i, 200);
+	}
+
+	// Freed in any order, the whole run goes back as a single free block
+	for (i = 0; i < 50; i++)
+	{
+		ptr = batch[i];
+		batch[i] = batch[99 - i];
+		batch[99 - i] = ptr;
+	}
+	during = sma_stats();
+	sma_free_batch(batch, 100);
+	after = sma_stats();
+
+	if (count == 0 && during.bytesInUse >= before.bytesInUse + 100 * 200 &&
+		after.bytesInUse == before.bytesInUse && after.freeBlockCount <= before.freeBlockCount)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 17: Sized Free Test
+	puts("Test 17: Check for sized free...");
+
+	before = sma_stats();
+	for (i = 0; i < 32; i++)
+		c[i] = (char *)sma_malloc(i * 100 + 1);
+
+	during = sma_stats();
+
+	// A size larger than the block is caught, and the block is still freed
+	sma_free_sized(c[5], 100000);
+	after = sma_stats();
+	count = after.bytesInUse < during.bytesInUse ? 0 : 1;
+
+	// Any size up to the block's is legal, however far below it
+	sma_free_sized(c[20], 1);
+	for (i = 0; i < 32; i++)
+		if (i != 5 && i != 20)
+			sma_free_sized(c[i], i * 100 + 1);
+	after = sma_stats();
+
+	if (count == 0 && after.bytesInUse == before.bytesInUse)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 18: Compact Header Test
+	puts("Test 18: Check for headers without footers on allocated blocks...");
+
+	// An allocated block only costs the length word of its header, its last 8 bytes sit in the footer slot after it
+	before = sma_stats();
+	count = 0;
+	for (i = 0; i < 32; i++)
+	{
+		c[i] = (char *)sma_malloc(104);
+		if (sma_usable_size(c[i]) != 104)
+			count++;
+		memset(c[i], 0xFF, sma_usable_size(c[i]));
+	}
+	during = sma_stats();
+
+	// Payloads written up to their last byte don't get in the way of coalescing
+	for (i = 0; i < 32; i += 2)
+		sma_free(c[i]);
+	for (i = 1; i < 32; i += 2)
+		sma_free(c[i]);
+	after = sma_stats();
+
+	if (count == 0 && during.bytesInUse - before.bytesInUse == 32 * 96 && after.bytesInUse == before.bytesInUse &&
+		after.freeBlockCount <= before.freeBlockCount)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 19: Aligned Fit Test
+	puts("Test 19: Check for aligned payloads placed in free blocks...");
+
+	// A free hole of 64 KB between two allocated blocks, at least one free block can hold the buffer
+	ct = (char *)sma_malloc(64 * 1024);
+	ptr = sma_malloc(64);
+	sma_free(ct);
+	before = sma_stats();
+
+	// The page-aligned buffer is found in a free block, the slack around it stays free
+	count = 0;
+	char *page = (char *)sma_aligned_alloc(4096, 8000);
+	during = sma_stats();
+	if ((unsigned long)page % 4096 != 0 || during.heapGrownBytes != before.heapGrownBytes ||
+		during.freeBytes + 8000 + 2 * 16 + 4096 < before.freeBytes)
+		count++;
+
+	void *vector = NULL;
+	if (sma_posix_memalign(&vector, 24, 100) != EINVAL || sma_posix_memalign(&vector, 64, 100) != 0 ||
+		(unsigned long)vector % 64 != 0)
+		count++;
+
+	sma_free(page);
+	sma_free(vector);
+	sma_free(ptr);
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 20: Calloc Test
+	puts("Test 20: Check for zeroed memory from sma_calloc...");
+
+	count = 0;
+	// Recycled blocks, small ones are cleared with memset
+	for (i = 0; i < 4; i++)
+	{
+		c[i] = (char *)sma_malloc(5000);
+		memset(c[i], 0xFF, 5000);
+	}
+	for (i = 0; i < 4; i++)
+		sma_free(c[i]);
+	for (i = 0; i < 4; i++)
+	{
+		c[i] = (char *)sma_calloc(1000, 5);
+		for (int j = 0; j < 5000; j++)
+			if (c[i][j] != 0)
+				count++;
+	}
+	for (i = 0; i < 4; i++)
+		sma_free(c[i]);
+
+	// A large recycled block has its pages dropped, the program break is held up by ptr
+	sma_mallopt(MMAP_THRESHOLD, (size_t)8 * 1024 * 1024);
+	ct = (char *)sma_malloc(4 * 1024 * 1024);
+	ptr = sma_malloc(64);
+	memset(ct, 0xFF, 4 * 1024 * 1024);
+	sma_free(ct);
+	ct = (char *)sma_calloc(4 * 1024, 1024);
+	for (i = 0; i < 4 * 1024 * 1024; i++)
+		if (ct[i] != 0)
+			count++;
+	sma_free(ct);
+	sma_free(ptr);
+	sma_mallopt(MMAP_THRESHOLD, (size_t)128 * 1024);
+
+	// Mapped blocks come zeroed from the kernel
+	ct = (char *)sma_calloc(1, 200 * 1024);
+	for (i = 0; i < 200 * 1024; i++)
+		if (ct[i] != 0)
+			count++;
+	sma_free(ct);
+
+	if (sma_calloc((size_t)-1 / 2, 4) != NULL)
+		count++;
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 21: Purge Test
+	puts("Test 21: Check for free pages given back to the system...");
+
+	count = 0;
+	// A hole of 100 KB in the middle of the heap, the break can't move down over it
+	ct = (char *)sma_malloc(100 * 1024);
+	ptr = sma_malloc(64);
+	memset(ct, 0xFF, 100 * 1024);
+	sma_free(ct);
+	before = sma_stats();
+	if (sma_trim() < 96 * 1024 || sma_stats().purgedBytes < before.purgedBytes + 96 * 1024)
+		count++;
+
+	// The pages come back on reuse
+	ct = (char *)sma_malloc(100 * 1024);
+	memset(ct, 0x5A, 100 * 1024);
+	if (ct[50 * 1024] != 0x5A)
+		count++;
+	sma_free(ct);
+
+	// Without a delay the next clock check purges the hole, one in every 1024 allocations
+	sma_mallopt(PURGE_DELAY, 0);
+	before = sma_stats();
+	for (i = 0; i < 2048; i++)
+		sma_free(sma_malloc(2000));
+	if (sma_stats().purgedBytes < before.purgedBytes + 96 * 1024)
+		count++;
+	sma_mallopt(PURGE_DELAY, 10000);
+	sma_free(ptr);
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 22: Trim Hysteresis Test
+	puts("Test 22: Check for the program break kept across alloc/free cycles...");
+
+	count = 0;
+	sma_mallopt(MMAP_THRESHOLD, (size_t)8 * 1024 * 1024);
+	// The break moves back down after the first cycle only, from the second on it stays where it is
+	for (i = 0; i < 100; i++)
+	{
+		limitbefore = sbrk(0);
+		ct = (char *)sma_malloc(1024 * 1024);
+		memset(ct, i, 1024 * 1024);
+		sma_free(ct);
+		limitafter = sbrk(0);
+		if (i > 1 && limitafter != limitbefore)
+			count++;
+	}
+
+	// Once the buffer is gone for a few purge passes, the threshold decays and the top is trimmed
+	sma_mallopt(PURGE_DELAY, 0);
+	before = sma_stats();
+	for (i = 0; i < 8 * 1024; i++)
+		sma_free(sma_malloc(2000));
+	if (sma_stats().heapShrunkBytes < before.heapShrunkBytes + 512 * 1024)
+		count++;
+	sma_mallopt(PURGE_DELAY, 10000);
+	sma_mallopt(MMAP_THRESHOLD, (size_t)128 * 1024);
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 23: Trace Test
+	puts("Test 23: Check for the binary trace of the calls...");
+
+	count = 0;
+	if (!sma_trace_start("a3_test.trace"))
+		count++;
+	for (i = 0; i < 32; i++)
+		c[i] = (char *)sma_malloc(100 + i);
+	ct = (char *)sma_realloc(c[0], 5000);
+	for (i = 1; i < 32; i++)
+		sma_free(c[i]);
+	sma_free(ct);
+	// A batch shows up as one record per block
+	if (sma_malloc_batch(64, 4, batch) != 4)
+		count++;
+	sma_free_batch(batch, 4);
+	if (sma_trace_stop() != 0)
+		count++;
+
+	// A header, then one record per call in the order of the calls
+	SmaTraceHeader header;
+	SmaTraceRecord records[73];
+	FILE *trace = fopen("a3_test.trace", "rb");
+	if (trace == NULL || fread(&header, sizeof(header), 1, trace) != 1 || fread(records, sizeof(SmaTraceRecord), 73, trace) != 73 ||
+		memcmp(header.magic, SMA_TRACE_MAGIC, 8) != 0 || header.recordSize != sizeof(SmaTraceRecord))
+		count++;
+	else if (records[0].op != SMA_TRACE_MALLOC || records[0].size != 100 ||
+			 records[32].op != SMA_TRACE_REALLOC || records[32].result != ct || records[32].address != records[0].result ||
+			 records[64].op != SMA_TRACE_FREE || records[64].address != ct || records[64].timestamp < records[0].timestamp)
+		count++;
+	else if (records[65].op != SMA_TRACE_MALLOC || records[65].size != 64 || records[68].op != SMA_TRACE_MALLOC ||
+			 records[69].op != SMA_TRACE_FREE || records[72].op != SMA_TRACE_FREE)
+		count++;
+	if (trace != NULL)
+		fclose(trace);
+	remove("a3_test.trace");
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 24: Heap Profile Test
+	puts("Test 24: Check for the sampled heap profile...");
+
+	count = 0;
+	if (!sma_profile_start(1))
+		count++;
+	// A thread only looks at the profiler every 64 KB, past that an interval of 1 byte samples every call
+	for (i = 0; i < 32; i++)
+	{
+		c[i] = (char *)sma_malloc(4000);
+		memset(c[i], 'p', 4000);
+	}
+	ct = (char *)sma_realloc(c[31], 8000);
+	if (!sma_profile_dump("a3_test.heap"))
+		count++;
+
+	// One line per live sampled block, with its stack
+	char line[1024];
+	int samples = 0;
+	FILE *profile = fopen("a3_test.heap", "r");
+	if (profile == NULL || fgets(line, sizeof(line), profile) == NULL || strncmp(line, "heap profile: ", 14) != 0 || strstr(line, "@ heap_v2/1\n") == NULL)
+		count++;
+	while (profile != NULL && fgets(line, sizeof(line), profile) != NULL)
+		samples += strncmp(line, "1: 4000 [1: 4000] @ 0x", 22) == 0;
+	if (samples < 8 || samples > 31)
+		count++;
+	if (profile != NULL)
+		fclose(profile);
+
+	for (i = 0; i < 31; i++)
+		sma_free(c[i]);
+	sma_free(ct);
+	sma_profile_dump("a3_test.heap");
+	profile = fopen("a3_test.heap", "r");
+	if (profile == NULL || fgets(line, sizeof(line), profile) == NULL || strncmp(line, "heap profile: 0: 0 [0: 0] @ heap_v2/1", 37) != 0)
+		count++;
+	if (profile != NULL)
+		fclose(profile);
+	sma_profile_stop();
+	remove("a3_test.heap");
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 25: Counters Test
+	puts("Test 25: Check for the free list walk and coalescing counters...");
+
+	count = 0;
+	sma_mallopt(NEXT_FIT);
+	for (i = 0; i < 32; i++)
+		c[i] = (char *)sma_malloc(2000);
+	for (i = 0; i < 32; i += 2)
+		sma_free(c[i]);
+	SmaCounters counters = sma_counters(true);
+	counters = sma_counters(false);
+	if (counters.mallocNodesVisited != 0 || counters.merges != 0 || counters.mallocWalkHistogram[0] != 0)
+		count++;
+
+	// None of the 16 holes fits, next fit walks past all of them and splits the top free block
+	ct = (char *)sma_malloc(4000);
+	counters = sma_counters(false);
+	if (counters.mallocNodesVisited < 16 || counters.mallocWalkHistogram[5] + counters.mallocWalkHistogram[6] == 0 || counters.splits == 0)
+		count++;
+	// Each odd block joins the holes next to it
+	for (i = 1; i < 32; i += 2)
+		sma_free(c[i]);
+	counters = sma_counters(false);
+	if (counters.merges < 16)
+		count++;
+
+	// The block behind it is in use, so the block is copied
+	c[0] = (char *)sma_malloc(2000);
+	c[1] = (char *)sma_malloc(2000);
+	c[0] = (char *)sma_realloc(c[0], 8000);
+	counters = sma_counters(true);
+	if (counters.reallocMoves != 1 || counters.reallocMovedBytes < 2000)
+		count++;
+	sma_free(c[0]);
+	sma_free(c[1]);
+	sma_free(ct);
+	sma_mallopt(WORST_FIT);
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 26: Heaps Test
+	puts("Test 26: Check for heaps of their own...");
+
+	count = 0;
+	SmaStats mainBefore = sma_stats();
+	Heap *heap = sma_heap_create(NEXT_FIT, 64 * 1024 * 1024);
+	if (heap == NULL)
+		count++;
+	// Even a block above the mmap threshold comes from the region of the heap
+	for (i = 0; heap != NULL && i < 32; i++)
+	{
+		c[i] = (char *)sma_heap_malloc(heap, i == 0 ? 4 * 1024 * 1024 : 3000);
+		if (c[i] == NULL || c[i] < (char *)heap || c[i] >= (char *)heap + 65 * 1024 * 1024)
+			count++;
+		else
+			memset(c[i], i, 3000);
+	}
+	if (heap != NULL)
+	{
+		ct = (char *)sma_heap_realloc(heap, c[5], 10000);
+		if (ct == NULL || ct[0] != 5 || ct[2999] != 5)
+			count++;
+		for (i = 6; i < 32; i += 2)
+			sma_heap_free(heap, c[i]);
+		SmaStats heapStats = sma_heap_stats(heap);
+		if (heapStats.allocatedBytes < 4 * 1024 * 1024 + 12 * 3000 || heapStats.heapGrownBytes < heapStats.allocatedBytes || heapStats.freeBlockCount == 0)
+			count++;
+		// Past its capacity the heap fails rather than spill over
+		if (sma_heap_malloc(heap, 128 * 1024 * 1024) != NULL)
+			count++;
+		// The blocks still live go with it
+		sma_heap_destroy(heap);
+	}
+
+	// Nothing of it shows up in the main heap
+	SmaStats mainAfter = sma_stats();
+	if (mainAfter.allocatedBytes != mainBefore.allocatedBytes || mainAfter.breakCalls != mainBefore.breakCalls)
+		count++;
+
+	// Heaps under the other policies, small blocks from slabs of the heap itself
+	Heap *tlsfHeap = sma_heap_create(TLSF_FIT, 0);
+	Heap *segregatedHeap = sma_heap_create(SEGREGATED_FIT, 0);
+	if (tlsfHeap == NULL || segregatedHeap == NULL)
+		count++;
+	for (i = 0; tlsfHeap != NULL && segregatedHeap != NULL && i < 32; i++)
+	{
+		c[i] = (char *)sma_heap_malloc(i % 2 ? tlsfHeap : segregatedHeap, 100 + 50 * i);
+		if (c[i] == NULL)
+			count++;
+	}
+	for (i = 0; tlsfHeap != NULL && segregatedHeap != NULL && i < 32; i++)
+		sma_heap_free(i % 2 ? tlsfHeap : segregatedHeap, c[i]);
+	if (tlsfHeap != NULL && sma_heap_stats(tlsfHeap).bytesInUse != 0)
+		count++;
+	sma_heap_destroy(tlsfHeap);
+	sma_heap_destroy(segregatedHeap);
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 27: TLSF Top Block Test
+	puts("Test 27: Check for a TLSF request the top free block already holds...");
+
+	count = 0;
+	sma_mallopt(TLSF_FIT);
+	sma_mallopt(MMAP_THRESHOLD, (size_t)64 * 1024 * 1024);
+	// The top block ends up in the size class of the request, which the TLSF search rounds past
+	for (i = 0; i < 3; i++)
+		sma_free(sma_malloc(4200000));
+	ct = (char *)sma_malloc(4194400);
+	if (ct == NULL)
+		count++;
+	else
+	{
+		memset(ct, 't', 4194400);
+		sma_free(ct);
+	}
+	sma_mallopt(MMAP_THRESHOLD, (size_t)128 * 1024);
+	sma_mallopt(WORST_FIT);
+
+	heap = sma_heap_create(TLSF_FIT, 0);
+	for (i = 0; heap != NULL && i < 3; i++)
+		sma_heap_free(heap, sma_heap_malloc(heap, 4200000));
+	if (heap == NULL || sma_heap_malloc(heap, 4194400) == NULL)
+		count++;
+	sma_heap_destroy(heap);
+
+	if (count == 0)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 28: Contiguous Growth Test
+	puts("Test 28: Check that a full region grows over its fence...");
+
+	// The second block uses the top free block up, the third extends the region instead of starting a new one
+	heap = sma_heap_create(WORST_FIT, 0);
+	c[0] = (char *)sma_heap_malloc(heap, 100);
+	c[1] = (char *)sma_heap_malloc(heap, 130032);
+	c[2] = (char *)sma_heap_malloc(heap, 2000);
+	for (i = 0; i < 3; i++)
+		sma_heap_free(heap, c[i]);
+	after = sma_heap_stats(heap);
+	sma_heap_destroy(heap);
+
+	if (after.freeBlockCount == 1)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
+	// Test 29: Thread Safe Mode Test
+	puts("Test 29: Check for threads allocating and freeing at once...");
+
+	// Last, thread safe mode can't be turned off again
+	sma_mallopt(THREAD_SAFE_MODE);
+	pthread_t threads[THREAD_COUNT];
+	int ids[THREAD_COUNT];
+
+	before = sma_stats();
+	for (i = 0; i < THREAD_COUNT; i++)
+	{
+		ids[i] = i;
+		pthread_create(&threads[i], NULL, churn_blocks, &ids[i]);
+	}
+	// Each thread gives its cache back as it exits
+	count = 0;
+	for (i = 0; i < THREAD_COUNT; i++)
+	{
+		pthread_join(threads[i], NULL);
+		count += corrupted[i];
+	}
+	// Created after the key of the thread caches, so its destructor runs after theirs
+	void *lateBlocks[8];
+	pthread_key_create(&lateKey, free_late_blocks);
+	pthread_create(&threads[0], NULL, leave_late_blocks, lateBlocks);
+	pthread_join(threads[0], NULL);
+	after = sma_stats();
+
+	histogramCount = 0;
+	for (i = 0; i < SMA_FREE_HISTOGRAM_BINS; i++)
+		histogramCount += after.freeBlockHistogram[i];
+
+	if (count == 0 && after.bytesInUse == before.bytesInUse && after.allocatedBytes > before.allocatedBytes &&
+		histogramCount == after.freeBlockCount && after.largestFreeBlock <= after.freeBytes)
+		puts("\t\t\t\t PASSED\n");
+	else
+		puts("\t\t\t\t FAILED\n");
+
 	return (0);
 }
\ No newline at end of file
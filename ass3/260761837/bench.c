@@ -0,0 +1,437 @@
+/*
+ * =====================================================================================
+ *
+ *	Filename:  		bench.c
+ *
+ * 	Description:	Allocation patterns timed against the SMA policies and
+ * 					the C library malloc.
+ *
+ * 	Usage:			./bench.exe [calls per pattern] [pattern]
+ *
+ * 	Every pattern runs in a child process of its own, so each allocator
+ * 	starts from an empty heap and the peak RSS belongs to that run only.
+ * 	Each malloc, free and realloc call is timed on its own for the
+ * 	percentiles, ops/sec is the number of calls over the wall time.
+ * =====================================================================================
+ */
+
+/* Includes */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "sma.h"
+
+#define DEFAULT_CALLS 200000  // Calls per pattern
+#define CHURN_SLOTS 4096  // Live blocks kept by the churn pattern
+#define QUEUE_SIZE 1024  // Blocks in flight between producer and consumer
+#define REALLOC_BUFFERS 16  // Buffers grown side by side by the realloc pattern
+#define REALLOC_MAX_SIZE (256 * 1024)  // A buffer starts over once it grows past this
+#define LARSON_THREADS 4
+#define LARSON_SLOTS 1024  // Live blocks per larson thread, handed to the next thread every round
+#define LARSON_ROUNDS 8
+#define BURST_BLOCKS 256  // Blocks of one power of two allocated before the burst is freed
+
+typedef struct __Allocator {
+    const char *name;
+    int policy;                       //    sma_mallopt policy, 0 for the C library
+} Allocator;
+
+typedef struct __Samples {
+    unsigned long *ns;                //    One latency per call, mapped so that it stays off the heap being measured
+    long count;
+    long capacity;
+    unsigned long random;             //    xorshift state of the thread that owns the samples
+} Samples;
+
+typedef struct __Result {
+    bool isValid;
+    long calls;
+    double opsPerSec;
+    unsigned long p50;
+    unsigned long p99;
+    unsigned long p999;
+} Result;
+
+typedef struct __Pattern {
+    const char *name;
+    bool isThreaded;                  //    sma needs THREAD_SAFE_MODE for it
+    bool (*run)(Samples *samples, long calls);
+} Pattern;
+
+Allocator allocators[] = {
+    {"WORST_FIT", WORST_FIT},
+    {"NEXT_FIT", NEXT_FIT},
+    {"SEGREGATED_FIT", SEGREGATED_FIT},
+    {"TLSF_FIT", TLSF_FIT},
+    {"glibc", 0},
+};
+
+Allocator *currentAllocator = NULL;   //    Allocator of this child process
+Samples threadSamples[LARSON_THREADS];  //  Per thread samples of the threaded patterns, merged once they join
+
+void *larsonSlots[LARSON_THREADS][LARSON_SLOTS];
+pthread_barrier_t larsonBarrier;
+long larsonCalls = 0;                 //    Calls per larson thread and round
+atomic_bool larsonFailed = false;
+
+void *queue[QUEUE_SIZE];              //    Single producer, single consumer ring
+atomic_long queueHead = 0;
+atomic_long queueTail = 0;
+
+unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+unsigned long next_random(Samples *samples) {
+    unsigned long x = samples->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    samples->random = x;
+
+    return x;
+}
+
+// Random size from 1 to maxSize, small sizes being the most common
+size_t random_size(Samples *samples, size_t maxSize) {
+    unsigned long r = next_random(samples);
+    size_t limit = (r & 7) == 0 ? maxSize : (maxSize < 256 ? maxSize : 256);
+
+    return (r >> 8) % limit + 1;
+}
+
+bool init_samples(Samples *samples, long capacity, unsigned long seed) {
+    samples->ns = mmap(NULL, capacity * sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    samples->count = 0;
+    samples->capacity = capacity;
+    samples->random = seed * 2654435761UL + 1;
+
+    return samples->ns != MAP_FAILED;
+}
+
+void record(Samples *samples, unsigned long start) {
+    unsigned long elapsed = now_ns() - start;
+    if (samples->count < samples->capacity) {
+        samples->ns[samples->count++] = elapsed;
+    }
+}
+
+void *timed_malloc(Samples *samples, size_t size) {
+    unsigned long start = now_ns();
+    void *ptr = currentAllocator->policy ? sma_malloc(size) : malloc(size);
+    record(samples, start);
+
+    if (ptr != NULL) {
+        // Touches the block so that its pages count in the RSS
+        *(char *)ptr = 1;
+    }
+    return ptr;
+}
+
+void timed_free(Samples *samples, void *ptr) {
+    unsigned long start = now_ns();
+    if (currentAllocator->policy) {
+        sma_free(ptr);
+    } else {
+        free(ptr);
+    }
+    record(samples, start);
+}
+
+void *timed_realloc(Samples *samples, void *ptr, size_t size) {
+    unsigned long start = now_ns();
+    void *newPtr = currentAllocator->policy ? sma_realloc(ptr, size) : realloc(ptr, size);
+    record(samples, start);
+
+    if (newPtr != NULL) {
+        *((char *)newPtr + size - 1) = 1;
+    }
+    return newPtr;
+}
+
+// Random sizes up to 4 KB, each call frees or fills a random slot
+bool run_churn(Samples *samples, long calls) {
+    static void *slots[CHURN_SLOTS];
+
+    for (long i = 0; i < calls; i++) {
+        int slot = next_random(samples) % CHURN_SLOTS;
+        if (slots[slot] != NULL) {
+            timed_free(samples, slots[slot]);
+            slots[slot] = NULL;
+        }
+        else if ((slots[slot] = timed_malloc(samples, random_size(samples, 4096))) == NULL) {
+            return false;
+        }
+    }
+    for (int slot = 0; slot < CHURN_SLOTS; slot++) {
+        if (slots[slot] != NULL) {
+            timed_free(samples, slots[slot]);
+        }
+    }
+    return true;
+}
+
+void *consume(void *arg) {
+    Samples *samples = &threadSamples[1];
+    long calls = *(long *)arg;
+
+    for (long i = 0; i < calls; i++) {
+        while (atomic_load(&queueTail) == atomic_load(&queueHead)) {
+            sched_yield();
+        }
+        long tail = atomic_load(&queueTail);
+        void *ptr = queue[tail % QUEUE_SIZE];
+        atomic_store(&queueTail, tail + 1);
+        if (ptr == NULL) {
+            break;
+        }
+        timed_free(samples, ptr);
+    }
+    return NULL;
+}
+
+// One thread allocates blocks up to 1 KB, another one frees them in the same order
+bool run_producer_consumer(Samples *samples, long calls) {
+    long blocks = calls / 2;
+    bool isValid = true;
+    pthread_t consumer;
+
+    if (!init_samples(&threadSamples[1], blocks, 2)) {
+        return false;
+    }
+    pthread_create(&consumer, NULL, consume, &blocks);
+    for (long i = 0; i < blocks; i++) {
+        while (atomic_load(&queueHead) - atomic_load(&queueTail) == QUEUE_SIZE) {
+            sched_yield();
+        }
+        void *ptr = isValid ? timed_malloc(samples, random_size(samples, 1024)) : NULL;
+        isValid = ptr != NULL;
+        long head = atomic_load(&queueHead);
+        queue[head % QUEUE_SIZE] = ptr;
+        atomic_store(&queueHead, head + 1);
+        if (!isValid) {
+            break;
+        }
+    }
+    pthread_join(consumer, NULL);
+
+    memcpy(samples->ns + samples->count, threadSamples[1].ns, threadSamples[1].count * sizeof(unsigned long));
+    samples->count += threadSamples[1].count;
+
+    return isValid;
+}
+
+// Buffers grown by half of their size at every call, as when appending to a vector
+bool run_realloc(Samples *samples, long calls) {
+    void *buffers[REALLOC_BUFFERS] = {NULL};
+    size_t sizes[REALLOC_BUFFERS];
+
+    for (long i = 0; i < calls; i++) {
+        int buffer = i % REALLOC_BUFFERS;
+        if (buffers[buffer] == NULL) {
+            sizes[buffer] = random_size(samples, 64);
+            buffers[buffer] = timed_malloc(samples, sizes[buffer]);
+        }
+        else if (sizes[buffer] > REALLOC_MAX_SIZE) {
+            timed_free(samples, buffers[buffer]);
+            buffers[buffer] = NULL;
+            continue;
+        }
+        else {
+            sizes[buffer] += sizes[buffer] / 2 + 16;
+            buffers[buffer] = timed_realloc(samples, buffers[buffer], sizes[buffer]);
+        }
+        if (buffers[buffer] == NULL) {
+            return false;
+        }
+    }
+    for (int buffer = 0; buffer < REALLOC_BUFFERS; buffer++) {
+        if (buffers[buffer] != NULL) {
+            timed_free(samples, buffers[buffer]);
+        }
+    }
+    return true;
+}
+
+void *larson_thread(void *arg) {
+    long id = (long)arg;
+    Samples *samples = &threadSamples[id];
+
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        // Every round works on the blocks allocated by the previous thread
+        void **slots = larsonSlots[(id + round) % LARSON_THREADS];
+        for (long i = 0; i < larsonCalls; i++) {
+            int slot = next_random(samples) % LARSON_SLOTS;
+            if (slots[slot] != NULL) {
+                timed_free(samples, slots[slot]);
+            }
+            if ((slots[slot] = timed_malloc(samples, random_size(samples, 512))) == NULL) {
+                atomic_store(&larsonFailed, true);
+            }
+        }
+        pthread_barrier_wait(&larsonBarrier);
+    }
+    return NULL;
+}
+
+// Threads replace random blocks, then pass their blocks on so that most frees come from another thread
+bool run_larson(Samples *samples, long calls) {
+    pthread_t threads[LARSON_THREADS];
+
+    larsonCalls = calls / 2 / LARSON_THREADS / LARSON_ROUNDS;
+    pthread_barrier_init(&larsonBarrier, NULL, LARSON_THREADS);
+    for (long id = 0; id < LARSON_THREADS; id++) {
+        if (!init_samples(&threadSamples[id], 2 * larsonCalls * LARSON_ROUNDS, id + 3)) {
+            return false;
+        }
+        pthread_create(&threads[id], NULL, larson_thread, (void *)id);
+    }
+    for (int id = 0; id < LARSON_THREADS; id++) {
+        pthread_join(threads[id], NULL);
+    }
+
+    for (int id = 0; id < LARSON_THREADS; id++) {
+        for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+            if (larsonSlots[id][slot] != NULL) {
+                timed_free(samples, larsonSlots[id][slot]);
+            }
+        }
+        memcpy(samples->ns + samples->count, threadSamples[id].ns, threadSamples[id].count * sizeof(unsigned long));
+        samples->count += threadSamples[id].count;
+    }
+    return !atomic_load(&larsonFailed);
+}
+
+// Bursts of blocks of one power of two, from 16 bytes to 64 KB, all freed before the next burst
+bool run_power_of_two(Samples *samples, long calls) {
+    void *blocks[BURST_BLOCKS];
+    int shift = 4;
+
+    for (long i = 0; i + 2 * BURST_BLOCKS <= calls; i += 2 * BURST_BLOCKS) {
+        for (int block = 0; block < BURST_BLOCKS; block++) {
+            if ((blocks[block] = timed_malloc(samples, 1UL << shift)) == NULL) {
+                return false;
+            }
+        }
+        for (int block = 0; block < BURST_BLOCKS; block++) {
+            timed_free(samples, blocks[block]);
+        }
+        shift = shift == 16 ? 4 : shift + 1;
+    }
+    return true;
+}
+
+Pattern patterns[] = {
+    {"churn", false, run_churn},
+    {"prodcons", true, run_producer_consumer},
+    {"realloc", false, run_realloc},
+    {"larson", true, run_larson},
+    {"pow2", false, run_power_of_two},
+};
+
+int compare_ns(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return (x > y) - (x < y);
+}
+
+unsigned long percentile(Samples *samples, double fraction) {
+    if (samples->count == 0) {
+        return 0;
+    }
+    return samples->ns[(long)(fraction * (samples->count - 1))];
+}
+
+// Runs in the child process, the result goes back through the pipe
+Result run_pattern(Pattern *pattern, long calls) {
+    Result result = {false};
+    Samples samples;
+
+    // Room for the frees of the blocks left at the end of a pattern
+    if (!init_samples(&samples, calls + LARSON_THREADS * LARSON_SLOTS + CHURN_SLOTS, 1)) {
+        return result;
+    }
+    if (currentAllocator->policy) {
+        if (pattern->isThreaded) {
+            sma_mallopt(THREAD_SAFE_MODE);
+        }
+        sma_mallopt(currentAllocator->policy);
+    }
+
+    unsigned long start = now_ns();
+    result.isValid = pattern->run(&samples, calls);
+    double seconds = (now_ns() - start) / 1e9;
+
+    qsort(samples.ns, samples.count, sizeof(unsigned long), compare_ns);
+    result.calls = samples.count;
+    result.opsPerSec = samples.count / seconds;
+    result.p50 = percentile(&samples, 0.5);
+    result.p99 = percentile(&samples, 0.99);
+    result.p999 = percentile(&samples, 0.999);
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    long calls = argc > 1 ? atol(argv[1]) : DEFAULT_CALLS;
+    const char *only = argc > 2 ? argv[2] : NULL;
+    char str[160];
+
+    if (calls <= 0) {
+        puts("Usage: ./bench.exe [calls per pattern] [churn|prodcons|realloc|larson|pow2]");
+        return 1;
+    }
+
+    sprintf(str, "%-10s %-15s %12s %9s %9s %9s %12s", "pattern", "allocator", "ops/sec", "p50 ns", "p99 ns", "p999 ns", "peak RSS KB");
+    puts(str);
+
+    for (int p = 0; p < (int)(sizeof(patterns) / sizeof(patterns[0])); p++) {
+        if (only != NULL && strcmp(only, patterns[p].name) != 0) {
+            continue;
+        }
+        for (int a = 0; a < (int)(sizeof(allocators) / sizeof(allocators[0])); a++) {
+            int fds[2];
+            Result result = {false};
+            struct rusage usage;
+            int status;
+
+            fflush(stdout);
+            if (pipe(fds) != 0) {
+                return 1;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                currentAllocator = &allocators[a];
+                result = run_pattern(&patterns[p], calls);
+                write(fds[1], &result, sizeof(result));
+                _exit(0);
+            }
+            close(fds[1]);
+            if (read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+                result.isValid = false;
+            }
+            close(fds[0]);
+            wait4(pid, &status, 0, &usage);
+
+            if (result.isValid) {
+                sprintf(str, "%-10s %-15s %12.0f %9lu %9lu %9lu %12ld", patterns[p].name, allocators[a].name,
+                        result.opsPerSec, result.p50, result.p99, result.p999, usage.ru_maxrss);
+            } else {
+                sprintf(str, "%-10s %-15s %12s", patterns[p].name, allocators[a].name, "FAILED");
+            }
+            puts(str);
+        }
+    }
+
+    return 0;
+}
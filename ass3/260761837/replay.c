@@ -0,0 +1,287 @@
+/*
+ * =====================================================================================
+ *
+ *	Filename:  		replay.c
+ *
+ * 	Description:	Replays a trace recorded by sma_trace_start, or by the
+ * 					preload library with SMA_TRACE, under every SMA policy.
+ *
+ * 	Usage:			./replay.exe trace
+ *
+ * 	The calls are replayed in the order of their time stamps from a single
+ * 	thread. A block the trace frees or reallocates is found through the
+ * 	address it had when it was recorded. Every policy runs in a child
+ * 	process of its own, so each starts from an empty heap. It prints the
+ * 	wall time, the peak of the program break above where it started, the
+ * 	number of sbrk and brk calls and the external fragmentation at every
+ * 	twentieth of the trace.
+ * =====================================================================================
+ */
+
+/* Includes */
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "sma.h"
+
+#define CURVE_POINTS 20  // Fragmentation samples over the trace
+
+typedef struct __Allocator {
+    const char *name;
+    int policy;                       //    sma_mallopt policy
+} Allocator;
+
+typedef struct __AddressSlot {
+    void *traceAddress;               //    Block as recorded, NULL for an empty slot
+    void *ptr;                        //    Block it stands for in this replay
+} AddressSlot;
+
+typedef struct __Result {
+    bool isValid;
+    double seconds;
+    size_t peakHeap;                  //    Highest program break above the one at the start
+    size_t breakCalls;
+    long skipped;                     //    Frees and reallocs of blocks allocated before the trace started
+    long failed;                      //    Calls that returned NULL in the replay but not in the trace
+    double fragmentation[CURVE_POINTS];
+} Result;
+
+Allocator allocators[] = {
+    {"WORST_FIT", WORST_FIT},
+    {"NEXT_FIT", NEXT_FIT},
+    {"SEGREGATED_FIT", SEGREGATED_FIT},
+    {"TLSF_FIT", TLSF_FIT},
+};
+
+SmaTraceHeader *traceHeader = NULL;
+SmaTraceRecord *records = NULL;       //    Mapped copy on write, sorted by time stamp in place
+long recordCount = 0;
+AddressSlot *addressMap = NULL;       //    Open addressing with linear probing, mapped so that it stays off the heap being measured
+unsigned long addressMapMask = 0;
+
+unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int compare_timestamps(const void *a, const void *b) {
+    unsigned long long x = ((const SmaTraceRecord *)a)->timestamp;
+    unsigned long long y = ((const SmaTraceRecord *)b)->timestamp;
+
+    return (x > y) - (x < y);
+}
+
+bool load_trace(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SmaTraceHeader)) {
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    traceHeader = (SmaTraceHeader *)map;
+    if (memcmp(traceHeader->magic, SMA_TRACE_MAGIC, sizeof(traceHeader->magic)) != 0 || traceHeader->recordSize != sizeof(SmaTraceRecord)) {
+        return false;
+    }
+    records = (SmaTraceRecord *)(map + sizeof(SmaTraceHeader));
+    recordCount = (st.st_size - sizeof(SmaTraceHeader)) / sizeof(SmaTraceRecord);
+    // Each thread flushes its own records, interleave them back into the order of the calls
+    qsort(records, recordCount, sizeof(SmaTraceRecord), compare_timestamps);
+
+    return true;
+}
+
+// Room for twice the records, no trace has more live blocks than records
+bool init_address_map() {
+    unsigned long capacity = 16;
+
+    while (capacity < 2 * (unsigned long)recordCount) {
+        capacity *= 2;
+    }
+    addressMap = mmap(NULL, capacity * sizeof(AddressSlot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    addressMapMask = capacity - 1;
+
+    return addressMap != MAP_FAILED;
+}
+
+unsigned long hash_address(void *traceAddress) {
+    return (((unsigned long)traceAddress >> 4) * 0x9E3779B97F4A7C15UL) >> 16;
+}
+
+// Returns the slot of traceAddress, or the empty slot where it would go
+unsigned long find_address(void *traceAddress) {
+    unsigned long index = hash_address(traceAddress) & addressMapMask;
+
+    while (addressMap[index].traceAddress != NULL && addressMap[index].traceAddress != traceAddress) {
+        index = (index + 1) & addressMapMask;
+    }
+    return index;
+}
+
+// A block the trace never freed, because its free was dropped, is replaced
+void insert_address(void *traceAddress, void *ptr) {
+    unsigned long index = find_address(traceAddress);
+
+    addressMap[index].traceAddress = traceAddress;
+    addressMap[index].ptr = ptr;
+}
+
+// Empties a slot and moves back the slots after it that probed past it, so no lookup stops early
+void remove_address(unsigned long index) {
+    unsigned long next = (index + 1) & addressMapMask;
+
+    while (addressMap[next].traceAddress != NULL) {
+        unsigned long home = hash_address(addressMap[next].traceAddress) & addressMapMask;
+        if (((next - home) & addressMapMask) >= ((next - index) & addressMapMask)) {
+            addressMap[index] = addressMap[next];
+            index = next;
+        }
+        next = (next + 1) & addressMapMask;
+    }
+    addressMap[index].traceAddress = NULL;
+}
+
+// Runs in the child process, the result goes back through the pipe
+Result replay(Allocator *allocator) {
+    Result result = {false};
+    void *heapBase = sbrk(0);
+    long point = 0;
+
+    if (!init_address_map()) {
+        return result;
+    }
+    sma_mallopt(allocator->policy);
+
+    unsigned long start = now_ns();
+    for (long i = 0; i < recordCount; i++) {
+        SmaTraceRecord *record = &records[i];
+        void *ptr = NULL;
+
+        if (record->op == SMA_TRACE_FREE || record->op == SMA_TRACE_REALLOC) {
+            unsigned long index = find_address(record->address);
+            if (addressMap[index].traceAddress == NULL) {
+                result.skipped++;
+                continue;
+            }
+            if (record->op == SMA_TRACE_FREE) {
+                sma_free(addressMap[index].ptr);
+                remove_address(index);
+            }
+            else if ((ptr = sma_realloc(addressMap[index].ptr, record->size)) != NULL) {
+                remove_address(index);
+            }
+        }
+        else if (record->op == SMA_TRACE_MALLOC) {
+            ptr = sma_malloc(record->size);
+        }
+        else if (record->op == SMA_TRACE_CALLOC) {
+            ptr = sma_calloc(1, record->size);
+        }
+        else if (record->op == SMA_TRACE_MEMALIGN) {
+            ptr = sma_memalign((size_t)record->address, record->size);
+        }
+
+        if (record->op != SMA_TRACE_FREE) {
+            if (ptr == NULL && record->result != NULL) {
+                result.failed++;
+            }
+            else if (ptr != NULL && record->result == NULL) {
+                // The trace doesn't know the block, it would never be freed
+                sma_free(ptr);
+            }
+            else if (ptr != NULL) {
+                insert_address(record->result, ptr);
+            }
+        }
+        if ((size_t)(sbrk(0) - heapBase) > result.peakHeap) {
+            result.peakHeap = sbrk(0) - heapBase;
+        }
+        while (point < CURVE_POINTS && i + 1 >= recordCount * (point + 1) / CURVE_POINTS) {
+            result.fragmentation[point++] = sma_stats().externalFragmentation;
+        }
+    }
+    result.seconds = (now_ns() - start) / 1e9;
+    result.breakCalls = sma_stats().breakCalls;
+    result.isValid = true;
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    char str[200];
+
+    if (argc < 2) {
+        puts("Usage: ./replay.exe trace");
+        return 1;
+    }
+    if (!load_trace(argv[1])) {
+        puts("Error: Not a trace written by sma_trace_start!");
+        return 1;
+    }
+    sprintf(str, "%ld calls", recordCount);
+    puts(str);
+    if (traceHeader->droppedRecords > 0) {
+        sprintf(str, "Warning: %lu calls were dropped while tracing, the blocks they freed stay live", traceHeader->droppedRecords);
+        puts(str);
+    }
+
+    Result results[sizeof(allocators) / sizeof(allocators[0])];
+    sprintf(str, "%-15s %10s %14s %10s %9s %9s", "policy", "wall ms", "peak heap KB", "brk calls", "skipped", "failed");
+    puts(str);
+
+    for (int a = 0; a < (int)(sizeof(allocators) / sizeof(allocators[0])); a++) {
+        int fds[2];
+        int status;
+
+        fflush(stdout);
+        results[a].isValid = false;
+        if (pipe(fds) != 0) {
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            Result result = replay(&allocators[a]);
+            write(fds[1], &result, sizeof(result));
+            _exit(0);
+        }
+        close(fds[1]);
+        if (read(fds[0], &results[a], sizeof(Result)) != sizeof(Result)) {
+            results[a].isValid = false;
+        }
+        close(fds[0]);
+        waitpid(pid, &status, 0);
+
+        if (results[a].isValid) {
+            sprintf(str, "%-15s %10.2f %14zu %10zu %9ld %9ld", allocators[a].name, results[a].seconds * 1000,
+                    results[a].peakHeap / 1024, results[a].breakCalls, results[a].skipped, results[a].failed);
+        } else {
+            sprintf(str, "%-15s %10s", allocators[a].name, "FAILED");
+        }
+        puts(str);
+    }
+
+    sprintf(str, "\nExternal fragmentation after every %d%% of the calls", 100 / CURVE_POINTS);
+    puts(str);
+    for (int a = 0; a < (int)(sizeof(allocators) / sizeof(allocators[0])); a++) {
+        if (!results[a].isValid) {
+            continue;
+        }
+        int length = sprintf(str, "%-15s", allocators[a].name);
+        for (int point = 0; point < CURVE_POINTS; point++) {
+            length += sprintf(str + length, " %4.2f", results[a].fragmentation[point]);
+        }
+        puts(str);
+    }
+
+    return 0;
+}
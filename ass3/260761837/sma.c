@@ -1,53 +1,277 @@
+#define _GNU_SOURCE  // mremap
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "sma.h"
 
-#define MAX_TOP_FREE (128 * 1024)  // Max top free block size = 128 Kbytes
-#define BLOCK_HEADER_SIZE 2 * sizeof(int)  // state (0 for free, 1 for allocated) + length
-#define BLOCK_FOOTER_SIZE 2 * sizeof(int)  // length + state (0 for free, 1 for allocated)
+#define MAX_TOP_FREE (128 * 1024)  // Top free block left when the break moves, up or down = 128 Kbytes
+#define MAX_TRIM_THRESHOLD (64 * 1024 * 1024)  // Cap of the learned trim threshold
+#define ALIGNMENT 16  // Every payload is 16-byte aligned and every block size a multiple of 16
+#define BLOCK_HEADER_SIZE (2 * sizeof(size_t))  // footer of the block before if it is free, else its last 8 bytes of data + length with the state bits, 16 bytes so the payload keeps the alignment
+#define LENT_FOOTER_SIZE sizeof(size_t)  // footer slot of the next header, only written once the block is free, so an allocated block holds data in it
+#define FENCE_SIZE BLOCK_HEADER_SIZE  // header of a zero-length allocated block, guards both ends of an sbrk region
+#define MAX_BLOCK_SIZE ((size_t)1 << 47)  // 128 TB, the whole user address space, so size arithmetic never wraps
+#define FREE_BLOCK_LINKS_SIZE (6 * sizeof(char *))  // prev + next + position in the free heap + prev + next in its TLSF list + time it was freed
 #define MIN_FREE_BLOCK_SIZE 1024  // 1KB
+#define MIN_SPLIT_SIZE (2 * sizeof(char *) + MIN_FREE_BLOCK_SIZE)  // Smallest remainder worth splitting off a free block
+#define FREE_HEAP_INIT_CAPACITY 1024  // Initial number of slots in the free heap
+#define TLSF_SL_LOG2 4  // Each power of two of sizes is split into 16 TLSF lists
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 4)  // Sizes below 256 bytes share first level 0, one list per 16 bytes
+#define TLSF_FL_COUNT 41  // First levels up to MAX_BLOCK_SIZE
+#define MAX_SMALL_BLOCK_SIZE 256  // Largest request served from a slab under SEGREGATED_FIT
+#define SIZE_CLASS_STEP 16  // Small requests are rounded up to a multiple of 16 bytes
+#define SIZE_CLASS_COUNT (MAX_SMALL_BLOCK_SIZE / SIZE_CLASS_STEP)
+#define SLAB_SIZE 4096  // Size and alignment of a slab, so an object finds its slab by masking its address
+#define SLAB_HEADER_SIZE 64  // Slab bookkeeping, a multiple of 16 so the objects stay 16-byte aligned
+#define SLABS_PER_SUPERBLOCK 16  // Slabs are carved 16 at a time out of one ordinary block
+#define SUPERBLOCK_HEADER_SIZE 16  // free slab count + first slab
+#define SUPERBLOCK_SIZE (SUPERBLOCK_HEADER_SIZE + (SLABS_PER_SUPERBLOCK + 1) * SLAB_SIZE)  // one extra slab of room for the alignment
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+#define SLAB_MAP_SIZE (2 * 1024 * 1024)  // Reserved once and never moved, covers 64 GB of heap
+#define FREE_MAP_BITS (1UL << 32)  // One bit per ALIGNMENT bytes from heapStart on, covers 64 GB of heap like the slab map
+#define FREE_MAP_LEVELS 6  // Each level has one bit per word of the level below, down to a single word
+#define THREAD_CACHE_MAX_SIZE 1024  // Largest block kept in a thread cache
+#define THREAD_CACHE_BIN_COUNT (THREAD_CACHE_MAX_SIZE / SIZE_CLASS_STEP)
+#define THREAD_CACHE_BIN_CAPACITY 32  // A full bin flushes half of its blocks to the central free list
+#define THREAD_CACHE_REFILL_COUNT 16  // Blocks taken from the central free list when a bin runs dry
+#define MAX_CACHE_OBJECT_SIZE 1024  // Largest object of an object cache, so a slab still holds a few of them
+#define ARENA_CHUNK_SIZE (64 * 1024)  // Default room for objects in an arena chunk, below the mmap threshold so chunks come from the heap
+#define ARENA_CHUNK_HEADER_SIZE 16  // next chunk + room for objects, keeps the objects 16-byte aligned
+#define HEAP_CAPACITY_DEFAULT (1UL << 30)  // Address space reserved for a heap of its own when sma_heap_create isn't given a capacity, 1 GB
+#define PURGE_DELAY_DEFAULT 10000  // Milliseconds a free page stays unused before it is given back
+#define PURGE_CHECK_INTERVAL 1024  // Ordinary allocations between two looks at the clock
+#define PURGE_BLOCKS_PER_STEP 16   // Free blocks a purge pass looks at per ordinary allocation
+#define PURGED_TIME 0  // Freed time of a block whose pages were given back since
+#define TRACE_RING_SIZE (128 * 1024)  // Records in the ring of a thread, 5 MB, a power of two so the index wraps by masking
+#define TRACE_FLUSH_INTERVAL 1000000  // Nanoseconds between two passes of the flusher thread
+#define PROFILE_INTERVAL_DEFAULT (512 * 1024)  // Mean bytes allocated between two samples of the heap profiler
+#define PROFILE_RECHECK_BYTES (64 * 1024)  // Bytes a thread allocates between two looks at isProfiling while the profiler is off
+#define PROFILE_MAX_DEPTH 30  // Frames kept of the stack of a sampled allocation
+#define PROFILE_TABLE_SIZE 16384  // Slots of the sample table, a power of two, kept at most half full
+#define MADVISE_ZERO_THRESHOLD (4 * 1024 * 1024)  // sma_calloc lets the kernel zero the whole pages of a recycled block from this size on
+
+// Hot path counters, under smaLock like the free list they count.
+// A walk adds up the free list nodes it visits, the histogram takes the sum when the call is done
+#ifndef SMA_NO_COUNTERS
+#define COUNT(counter, n) (counters.counter += (n))
+#define COUNT_VISIT() (walkLength++)
+#define RECORD_WALK(histogram, total) (counters.histogram[get_walk_bin(walkLength)]++, counters.total += walkLength, walkLength = 0)
+#define RESET_WALK() (walkLength = 0)
+#else
+#define COUNT(counter, n) ((void)0)
+#define COUNT_VISIT() ((void)0)
+#define RECORD_WALK(histogram, total) ((void)0)
+#define RESET_WALK() ((void)0)
+#endif
 
 #define FREE 1  // free block tag
 #define NOT_FREE 2  // allocated block tag
+#define MMAPPED 3  // allocated block with a mapping of its own
+#define BLOCK_TAG_BITS 3  // The tag sits in the low bits of the length, free since lengths are multiples of 16
+#define PREV_IN_USE 4  // Set in the length of a block if the block right before is not free, its footer can't be read then
+#define SAMPLED 8  // Set in the length of a block the heap profiler holds a sample of
+#define BLOCK_STATE_BITS 15
 
 typedef enum __Policy {
 	WORST,
-	NEXT
+	NEXT,
+	SEGREGATED,
+	TLSF
 } Policy;
 
+typedef struct __Superblock {
+    int freeSlabs;                    //    Slabs of this superblock sitting in the free slab list
+    Slab *firstSlab;
+} Superblock;
+
+typedef struct __SampledBlock {
+    void *ptr;                        //    NULL for an empty slot of the sample table
+    size_t size;                      //    Bytes asked for
+    int depth;
+    void *stack[PROFILE_MAX_DEPTH];   //    Return addresses from the allocation on out
+} SampledBlock;
+
+struct __ThreadCache {
+    void *bins[THREAD_CACHE_BIN_COUNT];   //  Blocks of at least (bin + 1) * 16 bytes, linked through their first word
+    int counts[THREAD_CACHE_BIN_COUNT];
+    bool isRegistered;                    //  Set while the exit handler knows about this cache
+};
+
+struct __Slab {
+    Slab *prev;                       //    Neighbours in the bin of its size class, or in the free slab list
+    Slab *next;
+    Superblock *superblock;
+    void *freeObjects;                //    Objects given back, linked through their first word
+    char *unusedObjects;              //    Objects never handed out yet start here
+    int objectSize;
+    int usedObjects;
+    int capacity;
+    ObjectCache *cache;               //    Owner of an object cache slab, NULL for a size class slab
+};
+
+struct __ObjectCache {
+    const char *name;
+    int objectSize;
+    int capacity;                     //    Objects per slab
+    void (*ctor)(void *);             //    Run once per object when its slab is created
+    void (*dtor)(void *);             //    Run once per object when its slab is released
+    Slab *partialSlabs;               //    Slabs with constructed objects ready to hand out
+    Slab *fullSlabs;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long slabCount;
+    unsigned long objectsInUse;
+};
+
+typedef struct __ArenaChunk {
+    struct __ArenaChunk *next;
+    size_t size;                      //    Bytes for objects behind the chunk header
+} ArenaChunk;
+
+struct __TraceBuffer {
+    TraceBuffer *next;                //    All rings, walked by the flusher thread
+    SmaTraceRecord *records;
+    unsigned long head;               //    Records written, only moved by the thread the ring belongs to
+    unsigned long tail;               //    Records flushed, only moved by the flusher thread
+    unsigned long dropped;            //    Records lost to a full ring
+    unsigned int threadId;
+    bool isOwned;                     //    Cleared when the thread exits, the next thread to trace takes the ring over
+};
+
+struct __Arena {
+    ArenaChunk *firstChunk;           //    Chunks are kept across resets and used again in order
+    ArenaChunk *currentChunk;         //    NULL right after a reset
+    char *cursor;                     //    Next object of the current chunk
+    char *limit;                      //    End of the current chunk
+    size_t chunkSize;
+};
+
+struct __Heap {
+    void *freeListHead;               //    The pointer to the HEAD of the doubly linked free memory list
+    void *freeListTail;               //    The pointer to the TAIL of the doubly linked free memory list
+    void *lastAllocatedPtr;           //    The pointer to the last allocated block
+    void *heapStart;                  //    Start of the first region, no block lives below it
+    void *heapEnd;                    //    The break as last moved by the allocator
+    void *heapUsedEnd;                //    End of the highest block ever handed out, above it the heap is zero but for free block links
+    void *regionBreak;                //    Break of a heap of its own, NULL for the main heap, which moves the program break
+    void *regionEnd;                  //    End of the address space reserved for a heap of its own
+    size_t totalAllocatedSize;        //    Total Allocated memory in Bytes
+    size_t totalFreeSize;             //    Total Free memory in Bytes in the free memory list
+    size_t blockInUseSize;            //    Payload bytes of the allocated ordinary blocks, superblocks included
+    size_t superblockSize;            //    Payload bytes of the superblocks, handed out again as slab objects
+    size_t slabInUseSize;             //    Bytes of the slab objects handed out
+    size_t mmappedSize;               //    Payload bytes of the mapped blocks
+    size_t mmappedCount;
+    size_t freeBlockCount;            //    Number of blocks in the free list
+    size_t freeBlockHistogram[SMA_FREE_HISTOGRAM_BINS];  //  Free blocks by power of two of their size
+    size_t heapGrownSize;             //    Bytes the allocator moved the break up by, alignment padding included
+    size_t heapShrunkSize;            //    Bytes the allocator gave back by moving the break down
+    size_t breakCalls;                //    Calls that tried to move the break
+    size_t trimThreshold;             //    The break moves down once the top free block is larger, raised when it has to move up again right after
+    bool isBreakTrimmed;              //    Set when the break last moved down
+    bool isHeapGrown;                 //    Set when the break moved up since the last purge pass
+    size_t purgedSize;                //    Bytes of free pages given back with madvise
+    unsigned long lastPurgeTime;
+    int purgeTick;                    //    Ordinary allocations since the clock was last read
+    void *purgeCursor;                //    Next free block of the purge pass under way, NULL between passes
+    unsigned long purgeCutoff;        //    The pass under way purges the blocks freed at or before this time
+    Policy policy;
+    size_t mmapThreshold;             //    Requests above this many bytes get a mapping of their own
+
+    void **freeHeap;                  //    Max-heap of the free blocks keyed by size, ties broken by address
+    int freeHeapCount;                //    Number of free blocks in the free heap
+    int freeHeapCapacity;             //    Number of slots mapped for the free heap
+    bool freeHeapValid;               //    False under TLSF_FIT or once the free heap failed to grow, worst fit then scans the list
+    void *tlsfLists[TLSF_FL_COUNT][TLSF_SL_COUNT];  //  Free blocks by size class, a power of two then a sixteenth of it
+    unsigned long tlsfFlBitmap;       //    Bit fl set if any list of first level fl holds a block
+    unsigned long tlsfSlBitmap[TLSF_FL_COUNT];  //  Bit sl set if tlsfLists[fl][sl] holds a block
+
+    Slab *smallBins[SIZE_CLASS_COUNT];  //  Slabs with room left, one list per size class
+    Slab *freeSlabList;               //    Slabs not serving any size class
+    unsigned long *slabMap;           //    One bit per SLAB_SIZE window from heapStart on, set if the window is a slab
+    unsigned long slabMapBits;        //    Number of windows covered by the slab map
+    unsigned long *freeMap[FREE_MAP_LEVELS];  //  Bit set at the start of every free block, finds the free list neighbours of a block
+    bool freeMapValid;                //    False once a free block fell outside of the free map, replace_block_freeList then walks the list
+};
+
 char *sma_malloc_error;
-void *freeListHead = NULL;			  //	The pointer to the HEAD of the doubly linked free memory list
-void *freeListTail = NULL;			  //	The pointer to the TAIL of the doubly linked free memory list
-void *lastAllocatedPtr = NULL;        //    The pointer to the last allocated block
-unsigned long totalAllocatedSize = 0; //	Total Allocated memory in Bytes
-unsigned long totalFreeSize = 0;	  //	Total Free memory in Bytes in the free memory list
-Policy currentPolicy = WORST;		  //	Current Policy
+long purgeDelay = PURGE_DELAY_DEFAULT;  //  Milliseconds, negative never purges
+unsigned long purgeClock = 0;         //    Milliseconds of the monotonic clock as last read, stamps the blocks freed
+SmaCounters counters;                 //    Stay zero when built with SMA_NO_COUNTERS
+size_t walkLength = 0;                //    Free list nodes visited by the call under way
+Heap mainHeap = {                     //    The heap of sma_malloc, grows the program break
+    .trimThreshold = MAX_TOP_FREE,
+    .policy = WORST,
+    .mmapThreshold = MAX_TOP_FREE,
+    .freeHeapValid = true,
+    .freeMapValid = true,
+};
+__thread Heap *currentHeap = &mainHeap;  //  Heap the calls of this thread work on, only another heap while a sma_heap call holds the lock
+
+bool isThreadSafe = false;            //    Set by sma_mallopt(THREAD_SAFE_MODE), never cleared
+pthread_mutex_t smaLock = PTHREAD_MUTEX_INITIALIZER;  //  Guards everything above in thread safe mode
+pthread_key_t threadCacheKey;         //    Flushes the cache of a thread when it exits
+__thread ThreadCache threadCache;     //    Blocks freed by this thread, reused without the lock
+
+bool isTracing = false;               //    Set by sma_trace_start, every public call then leaves a record
+int traceFd = -1;
+pthread_t traceThread;                //    Flushes the rings to traceFd in the background
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;  //  Guards the list of rings and the file
+TraceBuffer *traceBuffers = NULL;     //    Rings are kept for the life of the process and reused by the next trace
+pthread_key_t traceBufferKey;         //    Hands the ring of a thread back when it exits
+bool isTraceBufferKeyCreated = false;
+bool isTraceForkHandled = false;
+unsigned long long traceStartTimestamp = 0;
+struct timespec traceStartTime;
+__thread TraceBuffer *threadTraceBuffer = NULL;
+
+bool isProfiling = false;             //    Set by sma_profile_start
+size_t profileInterval = PROFILE_INTERVAL_DEFAULT;
+SampledBlock *sampleTable = NULL;     //    Live sampled blocks by address, open addressing, mapped when profiling first starts
+size_t sampledBlockCount = 0;         //    Read without the lock by sma_free, which only looks for the mark while it isn't 0
+__thread long sampleCountdown = 0;    //    Bytes this thread allocates before its next sample
+__thread unsigned long sampleRandom = 0;  //  xorshift state of the sample intervals of this thread
 
 bool IS_DEBUG_MODE = false;
 
-void *sma_malloc(int size) {
+void *sma_malloc(size_t size) {
     void *ptrMemory = NULL;
 
-    if (freeListHead == NULL) {
-        // Allocate memory by increasing the Program Break
-        ptrMemory = allocate_from_sbrk(size);
-    } else {
-        // Allocate memory from the free memory list
-        ptrMemory = allocate_from_freeList(size);
+    // The only cost of the profiler on a call that isn't sampled
+    if ((sampleCountdown -= size) < 0) {
+        ptrMemory = allocate_sampled_block(size);
+    }
+    if (ptrMemory == NULL && isThreadSafe) {
+        ptrMemory = allocate_from_thread_cache(size);
         if (ptrMemory == NULL) {
-            ptrMemory = allocate_from_sbrk(size);
+            pthread_mutex_lock(&smaLock);
+            ptrMemory = allocate_memory(size);
+            pthread_mutex_unlock(&smaLock);
         }
     }
+    else if (ptrMemory == NULL) {
+        ptrMemory = allocate_memory(size);
+    }
+    if (isTracing) {
+        trace_record(SMA_TRACE_MALLOC, size, NULL, ptrMemory);
+    }
     // Validates memory allocation
     if (ptrMemory == NULL || ptrMemory < 0) {
         sma_malloc_error = "Error: Memory allocation failed!";
         return NULL;
     }
 
-    lastAllocatedPtr = ptrMemory;
-    
     if (IS_DEBUG_MODE) {
         char str[100];
-        sprintf(str, "\tsma_malloc %d", size);
+        sprintf(str, "\tsma_malloc %zu", size);
         puts(str);
         debug();
     }
@@ -56,461 +280,2835 @@ void *sma_malloc(int size) {
 }
 
 void sma_free(void *ptr) {
+    // Recorded before the block can be handed out again, so no malloc of it by another thread comes first
+    if (isTracing) {
+        trace_record(SMA_TRACE_FREE, 0, ptr, NULL);
+    }
     if (ptr == NULL) {
 		puts("Error: Attempting to free NULL!");
 	}
-	// Checks if the ptr is beyond Program Break
-	else if (ptr > sbrk(0)) {
+	// Checks if the ptr is beyond Program Break, where only mapped blocks live
+	else if (ptr > sbrk(0) && !is_mmapped_block(ptr)) {
 		puts("Error: Attempting to free unallocated space!");
 	}
+    else if (sampledBlockCount != 0 && is_sampled_block(ptr)) {
+        free_sampled_block(ptr);
+    }
+    else if (isThreadSafe) {
+        if (!free_to_thread_cache(ptr, get_usable_size(ptr))) {
+            pthread_mutex_lock(&smaLock);
+            free_memory(ptr);
+            pthread_mutex_unlock(&smaLock);
+        }
+    }
     else {
-		replace_block_freeList(ptr);
+        free_memory(ptr);
     }
 
     if (IS_DEBUG_MODE) {
         char str[100];
-        sprintf(str, "\tsma_free %d", get_block_size(ptr));
+        sprintf(str, "\tsma_free %zu", get_usable_size(ptr));
         puts(str);
         debug();
     }
 }
 
-void *sma_realloc(void *ptr, int newSize) {
-    if (ptr == NULL || newSize <= 0) {
-        return NULL;
+// Allocates count * size bytes set to zero. Only recycled memory is cleared,
+// the heap above heapUsedEnd and mapped blocks are still zero from the kernel
+void *sma_calloc(size_t count, size_t size) {
+    void *ptrMemory = NULL;
+    size_t dirtySize = 0;
+
+    if (size != 0 && count > (size_t)-1 / size) {
+        sma_malloc_error = "Error: Memory allocation failed!";
+        return NULL;
+    }
+    size *= count;
+
+    // A sampled block is rare enough to be cleared in full
+    if ((sampleCountdown -= size) < 0) {
+        ptrMemory = allocate_sampled_block(size);
+        dirtySize = size;
+    }
+    if (ptrMemory == NULL && isThreadSafe) {
+        ptrMemory = allocate_from_thread_cache(size);
+        dirtySize = size;
+        if (ptrMemory == NULL) {
+            pthread_mutex_lock(&smaLock);
+            void *usedEnd = currentHeap->heapUsedEnd;
+            ptrMemory = allocate_memory(size);
+            dirtySize = get_dirty_size(ptrMemory, size, usedEnd);
+            pthread_mutex_unlock(&smaLock);
+        }
+    }
+    else if (ptrMemory == NULL) {
+        void *usedEnd = currentHeap->heapUsedEnd;
+        ptrMemory = allocate_memory(size);
+        dirtySize = get_dirty_size(ptrMemory, size, usedEnd);
+    }
+    if (isTracing) {
+        trace_record(SMA_TRACE_CALLOC, size, NULL, ptrMemory);
+    }
+    if (ptrMemory == NULL) {
+        sma_malloc_error = "Error: Memory allocation failed!";
+        return NULL;
+    }
+    // Outside of the lock, other threads don't wait for the clearing
+    clear_memory(ptrMemory, dirtySize);
+    // The footer slot past the block may still hold the footer of the free block it was carved from
+    if (dirtySize < size && !is_mmapped_block(ptrMemory) && size > get_block_size(ptrMemory)) {
+        *(size_t *)(ptrMemory + get_block_size(ptrMemory)) = 0;
+    }
+
+    return ptrMemory;
+}
+
+// Frees a block the caller knows the size of, the size it asked for or any up to its usable size.
+// Skips the ownership check of sma_free, builds without NDEBUG check the size against the block instead
+void sma_free_sized(void *ptr, size_t size) {
+    if (isTracing) {
+        trace_record(SMA_TRACE_FREE, size, ptr, NULL);
+    }
+    if (ptr == NULL) {
+        puts("Error: Attempting to free NULL!");
+        return;
+    }
+#ifndef NDEBUG
+    if (ptr > sbrk(0) && !is_mmapped_block(ptr)) {
+        puts("Error: Attempting to free unallocated space!");
+        return;
+    }
+    // A block can be larger than the request by the link minimum, the rounding, a remainder too small
+    // to split off or a realloc that grew in place, so only a larger size is wrong. The block is freed anyway
+    size_t usableSize = get_usable_size(ptr);
+    if (size > usableSize) {
+        puts("Error: Attempting to free with a size larger than the block!");
+    }
+    // The cached block keeps its whole size, so checks on later frees of it don't drift
+    size = usableSize;
+#endif
+
+    if (sampledBlockCount != 0 && is_sampled_block(ptr)) {
+        free_sampled_block(ptr);
+    }
+    else if (isThreadSafe) {
+        // The block holds at least size bytes, so the bin is taken by rounding down. A slab object can be
+        // smaller than the links of a free list block, but not than its size class
+        if (size < FREE_BLOCK_LINKS_SIZE && !is_slab_object(ptr)) {
+            size = FREE_BLOCK_LINKS_SIZE;
+        }
+        else if (size < SIZE_CLASS_STEP) {
+            size = SIZE_CLASS_STEP;
+        }
+        if (!free_to_thread_cache(ptr, size)) {
+            pthread_mutex_lock(&smaLock);
+            free_memory(ptr);
+            pthread_mutex_unlock(&smaLock);
+        }
+    }
+    else {
+        free_memory(ptr);
+    }
+}
+
+void *sma_realloc(void *ptr, size_t newSize) {
+    void *newPtr = NULL;
+
+    if (ptr == NULL || newSize == 0) {
+        return NULL;
+    }
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+        newPtr = reallocate_memory(ptr, newSize);
+        pthread_mutex_unlock(&smaLock);
+    }
+    else {
+        newPtr = reallocate_memory(ptr, newSize);
+    }
+    if (isTracing) {
+        trace_record(SMA_TRACE_REALLOC, newSize, ptr, newPtr);
+    }
+
+    return newPtr;
+}
+
+// Allocates a block whose payload starts on a multiple of alignment, a power of two
+void *sma_memalign(size_t alignment, size_t size) {
+    void *ptrMemory = NULL;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        sma_malloc_error = "Error: Alignment is not a power of two!";
+        return NULL;
+    }
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+        ptrMemory = allocate_aligned_block(alignment, size);
+        pthread_mutex_unlock(&smaLock);
+    }
+    else {
+        ptrMemory = allocate_aligned_block(alignment, size);
+    }
+    if (isTracing) {
+        trace_record(SMA_TRACE_MEMALIGN, size, (void *)alignment, ptrMemory);
+    }
+    if (ptrMemory == NULL) {
+        sma_malloc_error = "Error: Memory allocation failed!";
+    }
+
+    return ptrMemory;
+}
+
+// C11 aligned_alloc, alignment has to be a power of two
+void *sma_aligned_alloc(size_t alignment, size_t size) {
+    return sma_memalign(alignment, size);
+}
+
+// POSIX posix_memalign, alignment has to be a power of two multiple of sizeof(void *)
+int sma_posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        sma_malloc_error = "Error: Alignment is not a power of two multiple of sizeof(void *)!";
+        return EINVAL;
+    }
+    void *newPtr = sma_memalign(alignment, size);
+    if (newPtr == NULL) {
+        return ENOMEM;
+    }
+    *ptr = newPtr;
+
+    return 0;
+}
+
+// Moves the break down to the top free block's room and gives the free pages of every
+// free block back to the system at once, like malloc_trim. Returns the number of bytes given back
+size_t sma_trim() {
+    size_t released = 0;
+
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    void *topBlock = get_top_free_block();
+    if (topBlock != NULL) {
+        released = currentHeap->heapShrunkSize;
+        trim_top_free_block(topBlock);
+        released = currentHeap->heapShrunkSize - released;
+    }
+    released += purge_free_blocks(ULONG_MAX);
+    currentHeap->purgeCursor = NULL;
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+
+    return released;
+}
+
+// Starts recording every call to path, in records of SmaTraceRecord behind an SmaTraceHeader.
+// Each thread fills a ring of its own without a lock, a background thread writes the rings out
+bool sma_trace_start(const char *path) {
+    pthread_mutex_lock(&traceLock);
+    if (isTracing) {
+        pthread_mutex_unlock(&traceLock);
+        sma_malloc_error = "Error: A trace is already running!";
+        return false;
+    }
+    // A child forked while the flusher holds the lock would never see it released
+    if (!isTraceForkHandled) {
+        pthread_atfork(lock_trace_before_fork, unlock_trace_after_fork, stop_trace_in_child);
+        isTraceForkHandled = true;
+    }
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (traceFd < 0) {
+        pthread_mutex_unlock(&traceLock);
+        sma_malloc_error = "Error: Cannot open the trace file!";
+        return false;
+    }
+    // The header is written again with the clock rate once the trace stops
+    SmaTraceHeader header = {SMA_TRACE_MAGIC, sizeof(SmaTraceRecord), 0, 0};
+    write(traceFd, &header, sizeof(header));
+    // Whatever a previous trace left in the rings is dropped
+    for (TraceBuffer *buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+        buffer->tail = buffer->head;
+        buffer->dropped = 0;
+    }
+    traceStartTimestamp = read_timestamp();
+    clock_gettime(CLOCK_MONOTONIC, &traceStartTime);
+    isTracing = true;
+    if (pthread_create(&traceThread, NULL, flush_trace_buffers_loop, NULL) != 0) {
+        isTracing = false;
+        close(traceFd);
+        pthread_mutex_unlock(&traceLock);
+        sma_malloc_error = "Error: Cannot start the trace thread!";
+        return false;
+    }
+    pthread_mutex_unlock(&traceLock);
+
+    return true;
+}
+
+// Stops the trace and writes out what is left in the rings, returns the number of records lost to full rings
+unsigned long sma_trace_stop() {
+    struct timespec now;
+    SmaTraceHeader header = {SMA_TRACE_MAGIC, sizeof(SmaTraceRecord), 0, 0};
+
+    pthread_mutex_lock(&traceLock);
+    if (!isTracing) {
+        pthread_mutex_unlock(&traceLock);
+        return 0;
+    }
+    isTracing = false;
+    pthread_mutex_unlock(&traceLock);
+    pthread_join(traceThread, NULL);
+
+    pthread_mutex_lock(&traceLock);
+    flush_trace_buffers();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - traceStartTime.tv_sec) * 1e9 + (now.tv_nsec - traceStartTime.tv_nsec);
+    header.ticksPerNanosecond = elapsed > 0 ? (read_timestamp() - traceStartTimestamp) / elapsed : 0;
+    for (TraceBuffer *buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+        header.droppedRecords += buffer->dropped;
+    }
+    pwrite(traceFd, &header, sizeof(header), 0);
+    close(traceFd);
+    traceFd = -1;
+    pthread_mutex_unlock(&traceLock);
+
+    return header.droppedRecords;
+}
+
+// Samples about one sma_malloc call per interval bytes (512 KB if 0) with its stack,
+// for as long as the block lives. The intervals between samples are drawn at random so no pattern is missed
+bool sma_profile_start(size_t interval) {
+    void *stack[1];
+
+    // The first backtrace loads the unwinder, which allocates
+    backtrace(stack, 1);
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    if (sampleTable == NULL) {
+        void *map = mmap(NULL, PROFILE_TABLE_SIZE * sizeof(SampledBlock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        sampleTable = map != MAP_FAILED ? (SampledBlock *)map : NULL;
+    }
+    if (sampleTable != NULL) {
+        profileInterval = interval != 0 ? interval : PROFILE_INTERVAL_DEFAULT;
+        isProfiling = true;
+    }
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+    if (!isProfiling) {
+        sma_malloc_error = "Error: Cannot map the sample table!";
+    }
+
+    return isProfiling;
+}
+
+// Stops sampling and forgets the samples of the blocks still live
+void sma_profile_stop() {
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    isProfiling = false;
+    for (int i = 0; sampleTable != NULL && i < PROFILE_TABLE_SIZE; i++) {
+        if (sampleTable[i].ptr != NULL) {
+            *(size_t *)(sampleTable[i].ptr - sizeof(size_t)) &= ~(size_t)SAMPLED;
+            sampleTable[i].ptr = NULL;
+        }
+    }
+    sampledBlockCount = 0;
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+}
+
+// Writes the live samples to path in the legacy text format of pprof, one line per block,
+// followed by the mappings of the process so pprof can name the frames
+bool sma_profile_dump(const char *path) {
+    char line[64 + PROFILE_MAX_DEPTH * 20];
+    size_t totalSize = 0;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        sma_malloc_error = "Error: Cannot open the profile file!";
+        return false;
+    }
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    for (int i = 0; sampleTable != NULL && i < PROFILE_TABLE_SIZE; i++) {
+        totalSize += sampleTable[i].ptr != NULL ? sampleTable[i].size : 0;
+    }
+    // Only the blocks still live are known, so the allocated columns repeat the live ones
+    int length = snprintf(line, sizeof(line), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                          sampledBlockCount, totalSize, sampledBlockCount, totalSize, profileInterval);
+    write(fd, line, length);
+    for (int i = 0; sampleTable != NULL && i < PROFILE_TABLE_SIZE; i++) {
+        SampledBlock *sample = &sampleTable[i];
+        if (sample->ptr == NULL) {
+            continue;
+        }
+        length = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", sample->size, sample->size);
+        for (int frame = 0; frame < sample->depth; frame++) {
+            length += snprintf(line + length, sizeof(line) - length, " %p", sample->stack[frame]);
+        }
+        line[length++] = '\n';
+        write(fd, line, length);
+    }
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+
+    write(fd, "\nMAPPED_LIBRARIES:\n", strlen("\nMAPPED_LIBRARIES:\n"));
+    int mapsFd = open("/proc/self/maps", O_RDONLY);
+    ssize_t count = 0;
+    while (mapsFd >= 0 && (count = read(mapsFd, line, sizeof(line))) > 0) {
+        write(fd, line, count);
+    }
+    if (mapsFd >= 0) {
+        close(mapsFd);
+    }
+    close(fd);
+
+    return true;
+}
+
+// A heap with a free list, policy and statistics of its own, in capacity bytes of address space (1 GB if 0).
+// The space is reserved up front and backed by pages as the heap grows. No block of the heap gets a mapping of its own,
+// so destroying it unmaps everything in one go
+Heap *sma_heap_create(int policy, size_t capacity) {
+    size_t headerSize = align_size(sizeof(Heap));
+
+    if (policy < WORST_FIT || policy > TLSF_FIT || capacity > MAX_BLOCK_SIZE) {
+        sma_malloc_error = "Error: Invalid heap policy or capacity!";
+        return NULL;
+    }
+    if (capacity == 0) {
+        capacity = HEAP_CAPACITY_DEFAULT;
+    }
+    void *region = mmap(NULL, headerSize + capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        sma_malloc_error = "Error: Cannot map the heap region!";
+        return NULL;
+    }
+
+    // The mapping is zero, so only the fields that start out otherwise are set
+    Heap *heap = (Heap *)region;
+    heap->regionBreak = region + headerSize;
+    heap->regionEnd = region + headerSize + capacity;
+    heap->trimThreshold = MAX_TOP_FREE;
+    // WORST_FIT to TLSF_FIT are the policies in order
+    heap->policy = (Policy)(policy - WORST_FIT);
+    heap->mmapThreshold = MAX_BLOCK_SIZE;
+    heap->freeHeapValid = heap->policy != TLSF;
+    heap->freeMapValid = true;
+
+    return heap;
+}
+
+void *sma_heap_malloc(Heap *heap, size_t size) {
+    enter_heap(heap);
+    void *ptrMemory = allocate_memory(size);
+    leave_heap();
+
+    if (ptrMemory == NULL) {
+        sma_malloc_error = "Error: Memory allocation failed!";
+    }
+    return ptrMemory;
+}
+
+void sma_heap_free(Heap *heap, void *ptr) {
+    if (ptr == NULL) {
+		puts("Error: Attempting to free NULL!");
+	}
+    // Only blocks inside the region of the heap are its own
+    else if (ptr < heap->heapStart || ptr >= heap->regionBreak) {
+		puts("Error: Attempting to free unallocated space!");
+    }
+    else {
+        enter_heap(heap);
+        free_memory(ptr);
+        leave_heap();
+    }
+}
+
+void *sma_heap_realloc(Heap *heap, void *ptr, size_t newSize) {
+    void *newPtr = NULL;
+
+    if (ptr == NULL || newSize == 0) {
+        return NULL;
+    }
+    enter_heap(heap);
+    newPtr = reallocate_memory(ptr, newSize);
+    leave_heap();
+
+    return newPtr;
+}
+
+// Reads the counters kept up to date by every allocation and free, nothing is walked
+SmaStats sma_heap_stats(Heap *heap) {
+    SmaStats stats;
+
+    enter_heap(heap);
+    stats.allocatedBytes = heap->totalAllocatedSize;
+    stats.bytesInUse = heap->blockInUseSize - heap->superblockSize + heap->slabInUseSize + heap->mmappedSize;
+    stats.freeBytes = heap->totalFreeSize;
+	//	The largest Contiguous Free Space is the top of the free heap
+    stats.largestFreeBlock = get_block_size(get_largest_free_block());
+    // A scan of the list made here isn't the work of any allocation
+    RESET_WALK();
+    stats.freeBlockCount = heap->freeBlockCount;
+    memcpy(stats.freeBlockHistogram, heap->freeBlockHistogram, sizeof(heap->freeBlockHistogram));
+    stats.externalFragmentation = heap->totalFreeSize ? 1.0 - (double)stats.largestFreeBlock / heap->totalFreeSize : 0.0;
+    // Whatever the break holds beyond the payloads went to boundary tags, fences and padding
+    stats.overheadBytes = (heap->heapGrownSize - heap->heapShrunkSize) - heap->blockInUseSize - heap->totalFreeSize + heap->mmappedCount * BLOCK_HEADER_SIZE;
+    stats.heapGrownBytes = heap->heapGrownSize;
+    stats.heapShrunkBytes = heap->heapShrunkSize;
+    stats.breakCalls = heap->breakCalls;
+    stats.purgedBytes = heap->purgedSize;
+    leave_heap();
+
+    return stats;
+}
+
+// Unmaps the region and the maps kept beside it, however many blocks are still live
+void sma_heap_destroy(Heap *heap) {
+    if (heap == NULL || heap == &mainHeap) {
+        return;
+    }
+    if (heap->freeHeap != NULL) {
+        munmap(heap->freeHeap, heap->freeHeapCapacity * sizeof(void *));
+    }
+    if (heap->slabMap != NULL) {
+        munmap(heap->slabMap, SLAB_MAP_SIZE);
+    }
+    // The levels of the free map are carved out of one mapping, the last level is a single word
+    if (heap->freeMap[0] != NULL) {
+        munmap(heap->freeMap[0], (heap->freeMap[FREE_MAP_LEVELS - 1] + 1 - heap->freeMap[0]) * sizeof(unsigned long));
+    }
+    munmap(heap, heap->regionEnd - (void *)heap);
+}
+
+// Bytes the caller may use at ptr, at least as many as it asked for
+size_t sma_usable_size(void *ptr) {
+    return ptr != NULL ? get_usable_size(ptr) : 0;
+}
+
+// Allocates count blocks of size bytes with a single search, returns count or 0 if they don't fit
+size_t sma_malloc_batch(size_t size, size_t count, void **ptrs) {
+    size_t allocated = 0;
+
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+        allocated = allocate_batch(size, count, ptrs);
+        pthread_mutex_unlock(&smaLock);
+    }
+    else {
+        allocated = allocate_batch(size, count, ptrs);
+    }
+    // Traced as single mallocs, a replay then finds every block the program may free on its own
+    if (isTracing) {
+        for (size_t i = 0; i < allocated; i++) {
+            trace_record(SMA_TRACE_MALLOC, size, NULL, ptrs[i]);
+        }
+    }
+    if (allocated < count) {
+        sma_malloc_error = "Error: Memory allocation failed!";
+    }
+
+    return allocated;
+}
+
+// Frees count blocks at once, ptrs is sorted by address on return
+void sma_free_batch(void **ptrs, size_t count) {
+    if (isTracing) {
+        for (size_t i = 0; i < count; i++) {
+            trace_record(SMA_TRACE_FREE, 0, ptrs[i], NULL);
+        }
+    }
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+        free_batch(ptrs, count);
+        pthread_mutex_unlock(&smaLock);
+    }
+    else {
+        free_batch(ptrs, count);
+    }
+}
+
+// Creates an empty arena, its chunks hold chunkSize bytes of objects (64 KB if 0)
+Arena *sma_arena_create(size_t chunkSize) {
+    Arena *arena = sma_malloc(sizeof(Arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->firstChunk = NULL;
+    arena->currentChunk = NULL;
+    arena->cursor = NULL;
+    arena->limit = NULL;
+    arena->chunkSize = chunkSize ? align_size(chunkSize) : ARENA_CHUNK_SIZE;
+    // A chunk goes back to the free list, so it must be able to hold the links of a free block
+    if (ARENA_CHUNK_HEADER_SIZE + arena->chunkSize < FREE_BLOCK_LINKS_SIZE) {
+        arena->chunkSize = align_size(FREE_BLOCK_LINKS_SIZE) - ARENA_CHUNK_HEADER_SIZE;
+    }
+
+    return arena;
+}
+
+// Bumps the cursor of the current chunk, objects have no header and are never freed one by one
+void *sma_arena_alloc(Arena *arena, size_t size) {
+    if (size > MAX_BLOCK_SIZE) {
+        return NULL;
+    }
+    size = align_size(size ? size : 1);
+
+    if ((size_t)(arena->limit - arena->cursor) < size && !next_arena_chunk(arena, size)) {
+        sma_malloc_error = "Error: Memory allocation failed!";
+        return NULL;
+    }
+    void *object = arena->cursor;
+    arena->cursor += size;
+
+    return object;
+}
+
+// Forgets every object at once in O(1). All the chunks stay with the arena on purpose, so a round
+// as large as the largest one so far doesn't touch the free list, only destroy gives them back
+void sma_arena_reset(Arena *arena) {
+    arena->currentChunk = NULL;
+    arena->cursor = NULL;
+    arena->limit = NULL;
+}
+
+// Gives the chunks back to the free list, O(chunks) with one free per chunk whatever the number of objects
+void sma_arena_destroy(Arena *arena) {
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    ArenaChunk *chunk = arena->firstChunk;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        replace_block_freeList(chunk);
+        chunk = next;
+    }
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+    sma_free(arena);
+}
+
+// Creates a cache of objects of one size, ctor and dtor may be NULL
+ObjectCache *sma_cache_create(const char *name, size_t objectSize, void (*ctor)(void *), void (*dtor)(void *)) {
+    if (objectSize == 0 || objectSize > MAX_CACHE_OBJECT_SIZE) {
+        sma_malloc_error = "Error: Object size not supported by object caches!";
+        return NULL;
+    }
+    ObjectCache *cache = sma_malloc(sizeof(ObjectCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(ObjectCache));
+    cache->name = name;
+    cache->objectSize = align_size(objectSize);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+
+    // A slab holds a stack of free object indices, then the objects
+    cache->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / cache->objectSize;
+    while (align_size(cache->capacity) + cache->capacity * cache->objectSize > SLAB_SIZE - SLAB_HEADER_SIZE) {
+        cache->capacity--;
+    }
+
+    return cache;
+}
+
+// Hands out a constructed object, the ctor only runs when a new slab is needed
+void *sma_cache_alloc(ObjectCache *cache) {
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    void *object = allocate_cache_object(cache);
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+    if (object == NULL) {
+        sma_malloc_error = "Error: Memory allocation failed!";
+    }
+
+    return object;
+}
+
+// Takes an object back in its constructed state, sma_free does the same
+void sma_cache_free(ObjectCache *cache, void *object) {
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    // The slab of an object knows its cache, another one would lose count of what it handed out
+    if (object == NULL || !is_slab_object(object) || get_slab(object)->cache != cache) {
+        puts("Error: Attempting to free an object into a cache it doesn't belong to!");
+    }
+    else {
+        free_cache_object(object);
+    }
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+}
+
+// Destructs the objects and releases every slab, objects still handed out are lost
+void sma_cache_destroy(ObjectCache *cache) {
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    while (cache->partialSlabs != NULL) {
+        release_cache_slab(cache->partialSlabs);
+    }
+    while (cache->fullSlabs != NULL) {
+        release_cache_slab(cache->fullSlabs);
+    }
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+    sma_free(cache);
+}
+
+ObjectCacheStats sma_cache_stats(ObjectCache *cache) {
+    ObjectCacheStats stats;
+
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    stats.hits = cache->hits;
+    stats.misses = cache->misses;
+    stats.objectsInUse = cache->objectsInUse;
+    stats.slabCount = cache->slabCount;
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+
+    return stats;
+}
+
+void sma_mallopt(int policy, ...)
+{
+    bool isLocked = isThreadSafe;
+    if (isLocked) {
+        pthread_mutex_lock(&smaLock);
+    }
+	// Assigns the appropriate Policy
+	if (policy == 1) {
+		currentHeap->policy = WORST;
+	}
+	else if (policy == 2) {
+		currentHeap->policy = NEXT;
+        currentHeap->lastAllocatedPtr = NULL;
+	}
+	else if (policy == 3) {
+		currentHeap->policy = SEGREGATED;
+	}
+	else if (policy == 4) {
+		currentHeap->policy = TLSF;
+	}
+    // Keeping the free heap in order costs O(log n) per free, TLSF_FIT does without it
+    if (policy >= 1 && policy <= 4) {
+        if (currentHeap->policy == TLSF) {
+            currentHeap->freeHeapValid = false;
+            currentHeap->freeHeapCount = 0;
+        }
+        else if (!currentHeap->freeHeapValid) {
+            rebuild_free_heap();
+        }
+    }
+	if (policy == MMAP_THRESHOLD) {
+        va_list args;
+        va_start(args, policy);
+        // Read as a size_t so thresholds of 2 GB and more can be set, an int argument must be cast
+        currentHeap->mmapThreshold = va_arg(args, size_t);
+        va_end(args);
+	}
+	else if (policy == PURGE_DELAY) {
+        va_list args;
+        va_start(args, policy);
+        purgeDelay = va_arg(args, int);
+        va_end(args);
+	}
+	else if (policy == THREAD_SAFE_MODE && !isThreadSafe) {
+        pthread_key_create(&threadCacheKey, flush_thread_cache_on_exit);
+        // A child forked while another thread holds the lock would never see it released
+        pthread_atfork(lock_before_fork, unlock_after_fork, unlock_after_fork);
+        isThreadSafe = true;
+	}
+    if (isLocked) {
+        pthread_mutex_unlock(&smaLock);
+    }
+}
+
+void sma_mallinfo()
+{
+    SmaStats stats = sma_stats();
+	char str[80];
+
+	//	Prints the SMA Stats
+	sprintf(str, "Total number of bytes allocated: %zu", stats.allocatedBytes);
+	puts(str);
+	sprintf(str, "Total free space: %zu", stats.freeBytes);
+	puts(str);
+	sprintf(str, "Size of largest contigious free space (in bytes): %zu", stats.largestFreeBlock);
+	puts(str);
+}
+
+// Reads the counters kept up to date by every allocation and free, nothing is walked
+SmaStats sma_stats()
+{
+    return sma_heap_stats(&mainHeap);
+}
+
+// Reads the hot path counters since the last reset, and starts them over if isReset.
+// Only the calls that reach the free list are counted, not those served by a slab, a thread cache or a mapping
+SmaCounters sma_counters(bool isReset)
+{
+    SmaCounters result;
+
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    result = counters;
+    if (isReset) {
+        memset(&counters, 0, sizeof(counters));
+    }
+
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+    return result;
+}
+
+void *allocate_memory(size_t size) {
+    void *ptrMemory = NULL;
+
+    if (size > MAX_BLOCK_SIZE) {
+        return NULL;
+    }
+
+    if (size > currentHeap->mmapThreshold) {
+        ptrMemory = allocate_from_mmap(align_size(size));
+    }
+    else if (currentHeap->policy == SEGREGATED && size <= MAX_SMALL_BLOCK_SIZE) {
+        // Small requests never touch the free list, so their objects don't need room for its links
+        ptrMemory = allocate_small_block(size);
+    }
+    if (ptrMemory == NULL) {
+        ptrMemory = allocate_block(get_fitting_block_size(size));
+    }
+    if (ptrMemory != NULL) {
+        currentHeap->lastAllocatedPtr = ptrMemory;
+    }
+
+    return ptrMemory;
+}
+
+void free_memory(void *ptr) {
+    if (is_slab_object(ptr)) {
+        if (get_slab(ptr)->cache != NULL) {
+            free_cache_object(ptr);
+        } else {
+            free_small_block(ptr);
+        }
+    }
+    else if (is_mmapped_block(ptr)) {
+        free_mmapped_block(ptr);
+    }
+    else {
+        replace_block_freeList(ptr);
+    }
+}
+
+void *reallocate_memory(void *ptr, size_t newSize) {
+    if (newSize > MAX_BLOCK_SIZE) {
+        return NULL;
+    }
+    // The sample would be lost as soon as the block is moved or its header rewritten
+    if (sampledBlockCount != 0 && is_sampled_block(ptr)) {
+        forget_sampled_block(ptr);
+    }
+    if (is_slab_object(ptr)) {
+        size_t objectSize = get_usable_size(ptr);
+        if (newSize <= objectSize) {
+            return ptr;
+        }
+        void *newPtr = allocate_memory(newSize);
+        if (newPtr != NULL) {
+            memcpy(newPtr, ptr, objectSize);
+            free_memory(ptr);
+            COUNT(reallocMoves, 1);
+            COUNT(reallocMovedBytes, objectSize);
+        }
+        return newPtr;
+    }
+    if (is_mmapped_block(ptr)) {
+        return reallocate_mmapped_block(ptr, align_size(newSize < FREE_BLOCK_LINKS_SIZE ? FREE_BLOCK_LINKS_SIZE : newSize));
+    }
+
+    size_t ptrSize = get_block_size(ptr);
+    size_t requestedSize = newSize;
+    newSize = get_fitting_block_size(newSize);
+
+    if (newSize == ptrSize) {
+        return ptr;
+    }
+    else if (newSize < ptrSize) {
+        if (ptrSize >= newSize + BLOCK_HEADER_SIZE + MIN_SPLIT_SIZE) {
+            size_t freeBlockSize = ptrSize - newSize - BLOCK_HEADER_SIZE;
+            void *fakeAllocatedBlock = ptr + newSize + BLOCK_HEADER_SIZE;
+            set_block_header_footer(ptr, newSize, NOT_FREE);
+            set_block_header_footer(fakeAllocatedBlock, freeBlockSize, NOT_FREE);
+            currentHeap->blockInUseSize -= (ptrSize - newSize - freeBlockSize);
+            replace_block_freeList(fakeAllocatedBlock);
+            // Update SMA Info
+            currentHeap->totalAllocatedSize += freeBlockSize;
+            currentHeap->totalFreeSize -= (freeBlockSize + BLOCK_HEADER_SIZE);
+            currentHeap->totalFreeSize += (ptrSize - newSize);
+        }
+        // Update SMA Info
+        currentHeap->totalAllocatedSize -= (ptrSize - newSize);
+
+        return ptr;
+    }
+    else {
+        if (grow_block_in_place(ptr, newSize)) {
+            return ptr;
+        }
+        // Moves the data with a single copy, the old block is freed once the data is out of it.
+        // A slab object or a mapped block may not hold the footer slot, so it gets the request
+        void *newPtr = allocate_memory(requestedSize);
+        if (newPtr != NULL) {
+            memcpy(newPtr, ptr, ptrSize + LENT_FOOTER_SIZE);
+            replace_block_freeList(ptr);
+            COUNT(reallocMoves, 1);
+            COUNT(reallocMovedBytes, ptrSize + LENT_FOOTER_SIZE);
+        }
+
+        return newPtr;
+    }
+}
+
+// Takes a free block that holds an aligned payload, or over-allocates one,
+// then frees the slack on both sides of the payload
+void *allocate_aligned_block(size_t alignment, size_t size) {
+    if (alignment <= ALIGNMENT) {
+        return allocate_memory(size);
+    }
+    if (size > MAX_BLOCK_SIZE || alignment > MAX_BLOCK_SIZE) {
+        return NULL;
+    }
+    if (size < FREE_BLOCK_LINKS_SIZE) {
+        size = FREE_BLOCK_LINKS_SIZE;
+    }
+    size = align_size(size);
+
+    // The slack in front of the payload has to be able to hold a free block of its own
+    size_t leadRoom = BLOCK_HEADER_SIZE + align_size(FREE_BLOCK_LINKS_SIZE);
+    void *block = NULL;
+    void *freeBlock = get_aligned_fit_block(alignment, size, leadRoom);
+    if (freeBlock != NULL) {
+        RECORD_WALK(mallocWalkHistogram, mallocNodesVisited);
+        // Only up to the end of the aligned payload, the rest stays in the free list
+        block = allocate_block_from_freeList(freeBlock, get_aligned_payload(freeBlock, alignment, leadRoom) - freeBlock + size);
+    }
+    else {
+        block = allocate_block(size + alignment + leadRoom);
+    }
+    if (block == NULL) {
+        return NULL;
+    }
+
+    void *aligned = get_aligned_payload(block, alignment, leadRoom);
+    if (aligned != block) {
+        size_t blockSize = get_block_size(block);
+        size_t leadSize = aligned - block - BLOCK_HEADER_SIZE;
+        set_block_header_footer(block, leadSize, NOT_FREE);
+        set_block_header_footer(aligned, blockSize - leadSize - BLOCK_HEADER_SIZE, NOT_FREE);
+        currentHeap->blockInUseSize -= BLOCK_HEADER_SIZE;
+        replace_block_freeList(block);
+    }
+    currentHeap->lastAllocatedPtr = aligned;
+
+    // Shrinking in place splits off the slack behind the payload
+    return reallocate_memory(aligned, size);
+}
+
+// Returns the lowest free block with room for an aligned payload, or NULL.
+// TLSF_FIT doesn't walk the list and over-allocates instead, which keeps its bounded time
+void *get_aligned_fit_block(size_t alignment, size_t size, size_t leadRoom) {
+    if (currentHeap->policy == TLSF) {
+        return NULL;
+    }
+    void *cursor = currentHeap->freeListHead;
+
+    while (cursor != NULL) {
+        void *aligned = get_aligned_payload(cursor, alignment, leadRoom);
+        COUNT_VISIT();
+        if (aligned + size <= cursor + get_block_size(cursor)) {
+            return cursor;
+        }
+        cursor = get_free_block_next(cursor);
+    }
+
+    return NULL;
+}
+
+// The payload a block would hold at alignment, a misaligned one leaves room for a free block in front
+void *get_aligned_payload(void *block, size_t alignment, size_t leadRoom) {
+    if (((unsigned long)block & (alignment - 1)) == 0) {
+        return block;
+    }
+    return (void *)(((unsigned long)block + leadRoom + alignment - 1) & ~(unsigned long)(alignment - 1));
+}
+
+// Carves all blocks out of one ordinary block, each keeps boundary tags of its own so it can be freed alone
+size_t allocate_batch(size_t size, size_t count, void **ptrs) {
+    if (count == 0 || size > MAX_BLOCK_SIZE) {
+        return 0;
+    }
+    size = align_size(size);
+
+    // Slab objects and mapped blocks are placed one by one
+    if ((currentHeap->policy == SEGREGATED && size <= MAX_SMALL_BLOCK_SIZE) || size > currentHeap->mmapThreshold) {
+        for (size_t i = 0; i < count; i++) {
+            ptrs[i] = allocate_memory(size);
+            if (ptrs[i] == NULL) {
+                while (i > 0) {
+                    free_memory(ptrs[--i]);
+                }
+                return 0;
+            }
+        }
+        return count;
+    }
+    size = get_fitting_block_size(size);
+    size_t stride = size + BLOCK_HEADER_SIZE;
+    if (count > MAX_BLOCK_SIZE / stride) {
+        return 0;
+    }
+
+    void *block = allocate_block(count * stride - BLOCK_HEADER_SIZE);
+    if (block == NULL) {
+        return 0;
+    }
+    // The last block keeps whatever the free block had beyond the request
+    size_t blockSize = get_block_size(block);
+    for (size_t i = 0; i < count; i++) {
+        ptrs[i] = block + i * stride;
+        set_block_header_footer(ptrs[i], i < count - 1 ? size : blockSize - i * stride, NOT_FREE);
+    }
+    currentHeap->lastAllocatedPtr = ptrs[count - 1];
+
+    // Update SMA Info
+    currentHeap->blockInUseSize -= (count - 1) * BLOCK_HEADER_SIZE;
+    currentHeap->totalAllocatedSize -= (count - 1) * BLOCK_HEADER_SIZE;
+
+    return count;
+}
+
+// Sweeps the blocks in address order, a run of neighbours is joined into one block and freed once
+void free_batch(void **ptrs, size_t count) {
+    void *programBreak = sbrk(0);
+    void *run = NULL;
+
+    sort_pointers(ptrs, count);
+    for (size_t i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+
+        if (ptr == NULL) {
+            puts("Error: Attempting to free NULL!");
+            continue;
+        }
+        if (ptr > programBreak && !is_mmapped_block(ptr)) {
+            puts("Error: Attempting to free unallocated space!");
+            continue;
+        }
+        if (sampledBlockCount != 0 && is_sampled_block(ptr)) {
+            forget_sampled_block(ptr);
+        }
+        if (is_slab_object(ptr) || is_mmapped_block(ptr)) {
+            free_memory(ptr);
+            continue;
+        }
+
+        if (run != NULL && ptr == run + get_block_size(run) + BLOCK_HEADER_SIZE) {
+            set_block_header_footer(run, get_block_size(run) + BLOCK_HEADER_SIZE + get_block_size(ptr), NOT_FREE);
+            currentHeap->blockInUseSize += BLOCK_HEADER_SIZE;
+        }
+        else {
+            if (run != NULL) {
+                replace_block_freeList(run);
+            }
+            run = ptr;
+        }
+    }
+    if (run != NULL) {
+        replace_block_freeList(run);
+    }
+}
+
+// Heapsort by address, in place so that freeing never has to allocate
+void sort_pointers(void **ptrs, size_t count) {
+    for (size_t i = count / 2; i > 0; i--) {
+        sift_down_pointer(ptrs, i - 1, count);
+    }
+    for (size_t end = count; end > 1; end--) {
+        void *top = ptrs[0];
+        ptrs[0] = ptrs[end - 1];
+        ptrs[end - 1] = top;
+        sift_down_pointer(ptrs, 0, end - 1);
+    }
+}
+
+void sift_down_pointer(void **ptrs, size_t index, size_t count) {
+    void *ptr = ptrs[index];
+
+    while (2 * index + 1 < count) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < count && ptrs[child + 1] > ptrs[child]) {
+            child++;
+        }
+        if (ptrs[child] <= ptr) {
+            break;
+        }
+        ptrs[index] = ptrs[child];
+        index = child;
+    }
+    ptrs[index] = ptr;
+}
+
+// Moves an arena to the next chunk kept by a reset that has room for size bytes, or to a new one
+bool next_arena_chunk(Arena *arena, size_t size) {
+    ArenaChunk *chunk = arena->currentChunk ? arena->currentChunk->next : arena->firstChunk;
+    while (chunk != NULL && chunk->size < size) {
+        chunk = chunk->next;
+    }
+
+    if (chunk == NULL) {
+        size_t chunkSize = size > arena->chunkSize ? size : arena->chunkSize;
+        if (isThreadSafe) {
+            pthread_mutex_lock(&smaLock);
+        }
+        // An ordinary block even above the mmap threshold, so that it goes back to the free list
+        chunk = allocate_block(ARENA_CHUNK_HEADER_SIZE + chunkSize);
+        if (isThreadSafe) {
+            pthread_mutex_unlock(&smaLock);
+        }
+        if (chunk == NULL) {
+            return false;
+        }
+        chunk->size = get_block_size(chunk) - ARENA_CHUNK_HEADER_SIZE;
+
+        if (arena->currentChunk != NULL) {
+            chunk->next = arena->currentChunk->next;
+            arena->currentChunk->next = chunk;
+        } else {
+            chunk->next = arena->firstChunk;
+            arena->firstChunk = chunk;
+        }
+    }
+    arena->currentChunk = chunk;
+    arena->cursor = (char *)chunk + ARENA_CHUNK_HEADER_SIZE;
+    arena->limit = arena->cursor + chunk->size;
+
+    return true;
+}
+
+// Grows an allocated block over the free block right after it,
+// or by moving the program break when the block ends the heap
+bool grow_block_in_place(void *ptr, size_t newSize) {
+    size_t ptrSize = get_block_size(ptr);
+    void *nextBlock = ptr + ptrSize + BLOCK_HEADER_SIZE;
+    void *nextFreeBlock = NULL;
+    void *freePrev = NULL;
+    size_t nextFreeSize = 0;
+    size_t available = ptrSize;
+
+    if (get_block_tag(nextBlock) == FREE) {
+        nextFreeBlock = nextBlock;
+        nextFreeSize = get_block_size(nextFreeBlock);
+        freePrev = get_free_block_prev(nextFreeBlock);
+        available += BLOCK_HEADER_SIZE + nextFreeSize;
+    }
+    bool isTop = currentHeap->heapEnd == get_break() && ptr + available + FENCE_SIZE == currentHeap->heapEnd;
+
+    if (available >= newSize) {
+        remove_block_freeList(nextFreeBlock);
+
+        if (available >= newSize + BLOCK_HEADER_SIZE + MIN_SPLIT_SIZE) {
+            // What is left of the free block stays where it was in the free list
+            size_t remainderSize = available - newSize - BLOCK_HEADER_SIZE;
+            void *remainder = ptr + newSize + BLOCK_HEADER_SIZE;
+            set_block_header_footer(ptr, newSize, NOT_FREE);
+            set_block_header_footer(remainder, remainderSize, FREE);
+            insert_block_freeList(remainder, freePrev);
+            currentHeap->totalFreeSize -= (nextFreeSize - remainderSize);
+        }
+        else {
+            set_block_header_footer(ptr, available, NOT_FREE);
+            currentHeap->totalFreeSize -= nextFreeSize;
+        }
+        currentHeap->blockInUseSize += (get_block_size(ptr) - ptrSize);
+        set_heap_used_end(ptr);
+    }
+    else if (isTop) {
+        // Leaves a top free block of MAX_TOP_FREE behind the block, like allocate_from_sbrk
+        void *regionEnd = ptr + newSize + BLOCK_HEADER_SIZE + MAX_TOP_FREE + FENCE_SIZE;
+        if (move_break(regionEnd - currentHeap->heapEnd) == (void *)-1) {
+            return false;
+        }
+        if (nextFreeBlock != NULL) {
+            remove_block_freeList(nextFreeBlock);
+        }
+        currentHeap->heapGrownSize += (regionEnd - currentHeap->heapEnd);
+        currentHeap->heapEnd = regionEnd;
+        set_fence(currentHeap->heapEnd - FENCE_SIZE);
+        raise_trim_threshold(newSize);
+
+        set_block_header_footer(ptr, newSize, NOT_FREE);
+        void *topBlock = ptr + newSize + BLOCK_HEADER_SIZE;
+        set_block_header_footer(topBlock, MAX_TOP_FREE, FREE);
+        append_block_freeList(topBlock);
+        currentHeap->totalFreeSize += (MAX_TOP_FREE - nextFreeSize);
+        currentHeap->blockInUseSize += (newSize - ptrSize);
+        set_heap_used_end(ptr);
+    }
+    else {
+        return false;
+    }
+    // Update SMA Info
+    currentHeap->totalAllocatedSize += (newSize - ptrSize);
+
+    return true;
+}
+
+// Allocates an ordinary block with boundary tags from the free list or the program break
+void *allocate_block(size_t size) {
+    void *ptrMemory = NULL;
+
+    // The clock is read once every PURGE_CHECK_INTERVAL allocations, and right away to stamp the first free blocks
+    if (purgeClock == 0 || ++currentHeap->purgeTick == PURGE_CHECK_INTERVAL) {
+        purge_expired_blocks();
+    }
+    // A purge pass moves along the free list a few blocks per allocation, so no allocation walks all of it
+    if (currentHeap->purgeCursor != NULL) {
+        purge_next_free_blocks(PURGE_BLOCKS_PER_STEP);
+    }
+    if (currentHeap->freeListHead == NULL) {
+        // Allocate memory by increasing the Program Break
+        ptrMemory = allocate_from_sbrk(size);
+    } else {
+        // Allocate memory from the free memory list
+        ptrMemory = allocate_from_freeList(size);
+        if (ptrMemory == NULL) {
+            ptrMemory = allocate_from_sbrk(size);
+        }
+    }
+    RECORD_WALK(mallocWalkHistogram, mallocNodesVisited);
+
+    return ptrMemory;
+}
+
+void *allocate_from_sbrk(size_t size) {
+    void *newBlock = NULL;
+    void *freeBlock = NULL;
+
+    // Grows the top free block in place when it still sits right below the break, or a block over the fence
+    // when the region still ends at the break but its last block is in use. Otherwise starts a new region fenced on both ends
+    void *topBlock = get_top_free_block();
+    size_t topSize = 0;
+    void *sbrkHead = NULL;
+
+    if (topBlock != NULL && get_block_size(topBlock) >= size) {
+        // TLSF_FIT rounds the request up to the next size class and misses a top block in the class of the request
+        return allocate_block_from_freeList(topBlock, size);
+    }
+    if (topBlock != NULL || (currentHeap->heapEnd != NULL && currentHeap->heapEnd == get_break())) {
+        // The header of the old fence becomes the header of the new block, with the PREV_IN_USE bit it has
+        newBlock = topBlock != NULL ? topBlock : currentHeap->heapEnd - FENCE_SIZE + BLOCK_HEADER_SIZE;
+        void *regionEnd = newBlock + size + BLOCK_HEADER_SIZE + MAX_TOP_FREE + FENCE_SIZE;
+        sbrkHead = move_break(regionEnd - currentHeap->heapEnd);
+        if (sbrkHead == (void *)-1) {
+            return NULL;
+        }
+        if (topBlock != NULL) {
+            topSize = get_block_size(topBlock);
+            remove_block_freeList(topBlock);
+            // The old fence and the footer in it end up inside a block
+            memset(currentHeap->heapEnd - FENCE_SIZE, 0, FENCE_SIZE);
+        }
+        currentHeap->heapGrownSize += (regionEnd - currentHeap->heapEnd);
+        currentHeap->heapEnd = regionEnd;
+    }
+    else {
+        size_t regionSize = FENCE_SIZE + 2 * BLOCK_HEADER_SIZE + size + MAX_TOP_FREE + FENCE_SIZE;
+        // Pads the break up to the alignment, the region keeps it from then on since all of its sizes are multiples of it
+        size_t padding = -(unsigned long)get_break() & (ALIGNMENT - 1);
+        sbrkHead = move_break(padding + regionSize);
+        if (sbrkHead == (void *)-1) {
+            return NULL;
+        }
+        void *regionStart = sbrkHead + padding;
+        if (currentHeap->heapStart == NULL) {
+            currentHeap->heapStart = regionStart;
+        }
+        set_fence(regionStart);
+        newBlock = regionStart + FENCE_SIZE + BLOCK_HEADER_SIZE;
+        // Nothing comes before the first block but the fence
+        *(size_t *)(newBlock - sizeof(size_t)) = PREV_IN_USE;
+        currentHeap->heapEnd = regionStart + regionSize;
+        currentHeap->heapGrownSize += (padding + regionSize);
+    }
+    set_fence(currentHeap->heapEnd - FENCE_SIZE);
+    raise_trim_threshold(size);
+
+    // Update SMA Info
+    currentHeap->totalAllocatedSize += size;
+    currentHeap->totalFreeSize += (MAX_TOP_FREE - topSize);
+    currentHeap->blockInUseSize += size;
+
+    set_block_header_footer(newBlock, size, NOT_FREE);
+    set_heap_used_end(newBlock);
+
+    freeBlock = newBlock + size + BLOCK_HEADER_SIZE;
+    set_block_header_footer(freeBlock, MAX_TOP_FREE, FREE);
+    append_block_freeList(freeBlock);
+
+    return newBlock;
+}
+
+// Takes the lock and points the calls of this thread at heap until leave_heap.
+// Other threads keep working on the heap they point at, the main heap but for the same dance
+void enter_heap(Heap *heap) {
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    currentHeap = heap;
+}
+
+void leave_heap() {
+    currentHeap = &mainHeap;
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+}
+
+// The program break for the main heap, the end of the pages handed out so far for a heap of its own
+void *get_break() {
+    return currentHeap->regionBreak == NULL ? sbrk(0) : currentHeap->regionBreak;
+}
+
+// Moves the break up like sbrk, returns the old break or (void *)-1 once the reserved space runs out
+void *move_break(size_t increment) {
+    currentHeap->breakCalls++;
+    COUNT(breakCalls, 1);
+    // A wrapped size would move the break down
+    if (increment > MAX_BLOCK_SIZE) {
+        return (void *)-1;
+    }
+    if (currentHeap->regionBreak == NULL) {
+        return sbrk(increment);
+    }
+    void *oldBreak = currentHeap->regionBreak;
+    if (increment > (size_t)(currentHeap->regionEnd - oldBreak)) {
+        return (void *)-1;
+    }
+    currentHeap->regionBreak += increment;
+
+    return oldBreak;
+}
+
+// Moves the break down like brk. A heap of its own gives the whole pages above the new break back
+// with madvise, they fault back in as zero pages like those above the program break
+int set_break(void *newBreak) {
+    currentHeap->breakCalls++;
+    COUNT(breakCalls, 1);
+    if (currentHeap->regionBreak == NULL) {
+        return brk(newBreak);
+    }
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    void *firstPage = (void *)(((unsigned long)newBreak + pageSize - 1) & ~(pageSize - 1));
+    if (firstPage < currentHeap->regionBreak && madvise(firstPage, currentHeap->regionBreak - firstPage, MADV_DONTNEED) != 0) {
+        return -1;
+    }
+    currentHeap->regionBreak = newBreak;
+
+    return 0;
+}
+
+// Maps a block of its own so that sma_free can hand it straight back to the system
+void *allocate_from_mmap(size_t size) {
+    void *map = mmap(NULL, BLOCK_HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    void *newBlock = map + BLOCK_HEADER_SIZE;
+    *(size_t *)(newBlock - sizeof(size_t)) = size | MMAPPED;
+
+    // Update SMA Info
+    currentHeap->totalAllocatedSize += size;
+    currentHeap->mmappedSize += size;
+    currentHeap->mmappedCount++;
+
+    return newBlock;
+}
+
+void free_mmapped_block(void *ptr) {
+    size_t ptrSize = get_block_size(ptr);
+
+    munmap(ptr - BLOCK_HEADER_SIZE, BLOCK_HEADER_SIZE + ptrSize);
+    currentHeap->mmappedSize -= ptrSize;
+    currentHeap->mmappedCount--;
+}
+
+// The kernel resizes the mapping and moves its pages if needed, nothing is copied
+void *reallocate_mmapped_block(void *ptr, size_t newSize) {
+    size_t ptrSize = get_block_size(ptr);
+    void *map = mremap(ptr - BLOCK_HEADER_SIZE, BLOCK_HEADER_SIZE + ptrSize, BLOCK_HEADER_SIZE + newSize, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    void *newBlock = map + BLOCK_HEADER_SIZE;
+    *(size_t *)(newBlock - sizeof(size_t)) = newSize | MMAPPED;
+
+    // Update SMA Info
+    currentHeap->totalAllocatedSize += (newSize - ptrSize);
+    currentHeap->mmappedSize += (newSize - ptrSize);
+
+    return newBlock;
+}
+
+bool is_mmapped_block(void *ptr) {
+    return !is_slab_object(ptr) && get_block_tag(ptr) == MMAPPED;
+}
+
+// Called when the break moves up for a block of size bytes. If it had just moved down, the block
+// is likely to come and go again, so the top free block may now grow to twice the block and
+// its room before the break moves down, and later cycles don't move it at all
+void raise_trim_threshold(size_t size) {
+    size_t threshold = 2 * (size + BLOCK_HEADER_SIZE + MAX_TOP_FREE);
+
+    currentHeap->isHeapGrown = true;
+    if (!currentHeap->isBreakTrimmed) {
+        return;
+    }
+    currentHeap->isBreakTrimmed = false;
+    if (threshold > MAX_TRIM_THRESHOLD) {
+        threshold = MAX_TRIM_THRESHOLD;
+    }
+    if (threshold > currentHeap->trimThreshold) {
+        currentHeap->trimThreshold = threshold;
+    }
+}
+
+// Raises heapUsedEnd over an ordinary block handed out
+void set_heap_used_end(void *block) {
+    void *blockEnd = block + get_block_size(block);
+    if (blockEnd > currentHeap->heapUsedEnd) {
+        currentHeap->heapUsedEnd = blockEnd;
+    }
+}
+
+// Bytes at the start of a new block of size bytes that may not be zero, given heapUsedEnd before it was allocated.
+// Above usedEnd only the header and links of the free block that started right there were ever written
+size_t get_dirty_size(void *ptr, size_t size, void *usedEnd) {
+    if (ptr == NULL || is_slab_object(ptr)) {
+        return size;
+    }
+    if (is_mmapped_block(ptr)) {
+        return 0;
+    }
+    void *cleanStart = (usedEnd != NULL && usedEnd + BLOCK_HEADER_SIZE > ptr ? usedEnd + BLOCK_HEADER_SIZE : ptr) + FREE_BLOCK_LINKS_SIZE;
+    // cleanStart never comes before ptr
+    size_t dirtySize = cleanStart - ptr;
+
+    return dirtySize < size ? dirtySize : size;
+}
+
+// Zeroes size bytes at ptr. The kernel drops the whole pages of a large range and maps zero pages on
+// the next touch. A page fault costs about ten times a memset of the page, so this only pays for ranges
+// large enough that the caller is unlikely to touch all of them, and it gives their memory back meanwhile
+void clear_memory(void *ptr, size_t size) {
+    if (size >= MADVISE_ZERO_THRESHOLD) {
+        unsigned long pageSize = sysconf(_SC_PAGESIZE);
+        void *pageStart = (void *)(((unsigned long)ptr + pageSize - 1) & ~(pageSize - 1));
+        void *pageEnd = (void *)(((unsigned long)ptr + size) & ~(pageSize - 1));
+        if (madvise(pageStart, pageEnd - pageStart, MADV_DONTNEED) == 0) {
+            memset(ptr, 0, pageStart - ptr);
+            memset(pageEnd, 0, ptr + size - pageEnd);
+            return;
+        }
+    }
+    memset(ptr, 0, size);
+}
+
+void *allocate_from_freeList(size_t size) {
+	void *newBlock = NULL;
+
+    // Blocks too large for a slab are placed by worst fit under SEGREGATED
+    if (currentHeap->policy == WORST || currentHeap->policy == SEGREGATED) {
+		newBlock = allocate_worst_fit(size);
+    }
+    else if (currentHeap->policy == NEXT) {
+        newBlock = allocate_next_fit(size);
+    }
+    else if (currentHeap->policy == TLSF) {
+        newBlock = allocate_tlsf_fit(size);
+    }
+
+    return newBlock;
+}
+
+void *allocate_worst_fit(size_t size) {
+    void *newBlock = NULL;
+    void *largestFreeBlock = get_largest_free_block();
+
+    if (largestFreeBlock != NULL) {
+        newBlock = allocate_block_from_freeList(largestFreeBlock, size);
+    }
+
+    return newBlock;
+}
+
+void *allocate_next_fit(size_t size) {
+    void *newBlock = NULL;
+    void *nextFreeBlock = get_next_fit_block(size);
+
+    if (nextFreeBlock != NULL) {
+        newBlock = allocate_block_from_freeList(nextFreeBlock, size);
+    }
+
+    return newBlock;
+}
+
+// Takes the head of the first TLSF list whose blocks are all large enough, in constant time
+void *allocate_tlsf_fit(size_t size) {
+    void *newBlock = NULL;
+    void *freeBlock = get_tlsf_fit_block(size);
+
+    if (freeBlock != NULL) {
+        newBlock = allocate_block_from_freeList(freeBlock, size);
+    }
+
+    return newBlock;
+}
+
+void *allocate_block_from_freeList(void *freeBlock, size_t newBlockSize) {
+    size_t freeBlockSize = get_block_size(freeBlock);
+
+    if (freeBlockSize < newBlockSize) {
+        return NULL;
+    }
+
+    void *newBlock = freeBlock;
+    void *newFreeBlock = NULL;
+
+    if (freeBlockSize >= newBlockSize + BLOCK_HEADER_SIZE + MIN_SPLIT_SIZE) {
+        // The remainder takes over the place of freeBlock in the free list
+        size_t newFreeBlockSize = freeBlockSize - newBlockSize - BLOCK_HEADER_SIZE;
+        newFreeBlock = freeBlock + newBlockSize + BLOCK_HEADER_SIZE;
+        set_block_header_footer(newFreeBlock, newFreeBlockSize, FREE);
+        move_block_freeList(freeBlock, newFreeBlock);
+        set_block_header_footer(newBlock, newBlockSize, NOT_FREE);
+        COUNT(splits, 1);
+
+        currentHeap->totalFreeSize -= (newBlockSize + BLOCK_HEADER_SIZE);
+        currentHeap->blockInUseSize += newBlockSize;
+    }
+    else {
+        remove_block_freeList(freeBlock);
+        set_block_header_footer(newBlock, freeBlockSize, NOT_FREE);
+
+        currentHeap->totalFreeSize -= freeBlockSize;
+        currentHeap->blockInUseSize += freeBlockSize;
+    }
+    set_heap_used_end(newBlock);
+
+    // Update SMA Info
+    currentHeap->totalAllocatedSize += newBlockSize;
+
+    return newBlock;
+}
+
+void *get_largest_free_block() {
+    if (currentHeap->freeListHead == NULL) {
+        return NULL;
+    }
+    if (currentHeap->freeHeapValid) {
+        return currentHeap->freeHeap[0];
+    }
+    // Only the highest non empty TLSF list can hold the largest block
+    void *cursor = currentHeap->freeListHead;
+    bool isTlsfList = currentHeap->policy == TLSF;
+    if (isTlsfList) {
+        int fl = BITS_PER_LONG - 1 - __builtin_clzl(currentHeap->tlsfFlBitmap);
+        int sl = BITS_PER_LONG - 1 - __builtin_clzl(currentHeap->tlsfSlBitmap[fl]);
+        cursor = currentHeap->tlsfLists[fl][sl];
+    }
+    void *largestFreeBlock = cursor;
+    size_t cursorSize = 0;
+    size_t largestFreeBlockSize = 0;
+
+    while (cursor != NULL) {
+        COUNT_VISIT();
+        cursorSize = get_block_size(cursor);
+        if (cursorSize > largestFreeBlockSize) {
+            largestFreeBlockSize = cursorSize;
+            largestFreeBlock = cursor;
+        }
+        cursor = isTlsfList ? get_free_block_tlsf_next(cursor) : get_free_block_next(cursor);
+    }
+
+    return largestFreeBlock;
+}
+
+void *get_next_fit_block(size_t newBlockSize) {
+    if (currentHeap->freeListHead == NULL) {
+        return NULL;
+    }
+    void *cursorPtr = currentHeap->freeListHead;
+    void *nextFreeBlock = NULL, *restartFreeBlock = NULL;
+    size_t cursorSize;
+
+    while (cursorPtr != NULL) {
+        COUNT_VISIT();
+        cursorSize = get_block_size(cursorPtr);
+
+        if (restartFreeBlock == NULL && cursorSize >= newBlockSize && cursorPtr < currentHeap->lastAllocatedPtr) {
+            restartFreeBlock = cursorPtr;
+        }
+        if (nextFreeBlock == NULL && cursorSize >= newBlockSize && cursorPtr >= currentHeap->lastAllocatedPtr) {
+            nextFreeBlock = cursorPtr;
+            break;
+        }
+        cursorPtr = get_free_block_next(cursorPtr);
+    }
+
+    char str[100];
+    if (IS_DEBUG_MODE) {
+        sprintf(str, "\tlastAllocatedPtr %p, nextFreeBlock %p, restartFreeBlock %p", currentHeap->lastAllocatedPtr, nextFreeBlock, restartFreeBlock);
+        puts(str);
+    }
+
+    return nextFreeBlock ? nextFreeBlock : restartFreeBlock;
+}
+
+// Returns the tail of the free list if it is the last block below the program break
+void *get_top_free_block() {
+    if (currentHeap->freeListTail == NULL || currentHeap->heapEnd != get_break()) {
+        return NULL;
+    }
+    if (currentHeap->freeListTail + get_block_size(currentHeap->freeListTail) + FENCE_SIZE != currentHeap->heapEnd) {
+        return NULL;
+    }
+    return currentHeap->freeListTail;
+}
+
+// Replace allocated ptr to free ptr
+void replace_block_freeList(void *ptr) {
+    size_t ptrSize = get_block_size(ptr);
+
+    // Finds the free block right before ptr so the list stays address-ordered
+    void *freePrev = get_free_block_before(ptr);
+    RECORD_WALK(freeWalkHistogram, freeNodesVisited);
+
+    set_block_header_footer(ptr, ptrSize, FREE);
+    insert_block_freeList(ptr, freePrev);
+    // Update SMA Info
+    currentHeap->totalFreeSize += ptrSize;
+    currentHeap->blockInUseSize -= ptrSize;
+
+    // Coalesces with the neighbours found through the boundary tags
+    void *nextBlock = ptr + ptrSize + BLOCK_HEADER_SIZE;
+    if (get_block_tag(nextBlock) == FREE) {
+        merge_two_free_blocks(ptr, nextBlock);
+    }
+    if (is_prev_block_free(ptr)) {
+        size_t prevBlockSize = *(size_t *)(ptr - BLOCK_HEADER_SIZE);
+        merge_two_free_blocks(ptr - BLOCK_HEADER_SIZE - prevBlockSize, ptr);
+    }
+}
+
+// Returns the last free block below ptr, or NULL if ptr would be the new head of the free list
+void *get_free_block_before(void *ptr) {
+    if (currentHeap->freeListTail == NULL || currentHeap->freeListTail < ptr) {
+        return currentHeap->freeListTail;
+    }
+    if (currentHeap->freeMapValid && currentHeap->freeMap[0] != NULL && ptr >= currentHeap->heapStart && (unsigned long)(ptr - currentHeap->heapStart) % ALIGNMENT == 0) {
+        return find_free_map_prev((ptr - currentHeap->heapStart) / ALIGNMENT);
+    }
+
+    void *freePrev = NULL;
+    void *freeCursor = currentHeap->freeListHead;
+    while (freeCursor != NULL && freeCursor < ptr) {
+        COUNT_VISIT();
+        freePrev = freeCursor;
+        freeCursor = get_free_block_next(freeCursor);
+    }
+    return freePrev;
+}
+
+void append_block_freeList(void *ptr) {
+    size_t ptrSize = get_block_size(ptr);
+    set_block_header_footer(ptr, ptrSize, FREE);
+    insert_block_freeList(ptr, currentHeap->freeListTail);
+}
+
+// Links a free block into the free list right after prev, or at the head if prev is NULL
+void insert_block_freeList(void *block, void *prev) {
+    void *next = prev ? get_free_block_next(prev) : currentHeap->freeListHead;
+
+    set_free_block_prev(block, prev);
+    set_free_block_next(block, next);
+
+    if (prev != NULL) {
+        set_free_block_next(prev, block);
+    } else {
+        currentHeap->freeListHead = block;
+    }
+    if (next != NULL) {
+        set_free_block_prev(next, block);
+    } else {
+        currentHeap->freeListTail = block;
+    }
+
+    set_free_block_freed_time(block, purgeClock);
+    free_heap_insert(block);
+    tlsf_insert(block);
+    set_free_map(block, true);
+    count_free_block(get_block_size(block), 1);
+}
+
+void remove_block_freeList(void *block) {
+    void *prev = get_free_block_prev(block);
+    void *next = get_free_block_next(block);
+
+    if (prev != NULL) {
+        set_free_block_next(prev, next);
+    } else {
+        currentHeap->freeListHead = next;
+    }
+    if (next != NULL) {
+        set_free_block_prev(next, prev);
+    } else {
+        currentHeap->freeListTail = prev;
+    }
+    if (currentHeap->purgeCursor == block) {
+        currentHeap->purgeCursor = next;
+    }
+
+    free_heap_remove(block);
+    tlsf_remove(block, get_block_size(block));
+    set_free_map(block, false);
+    count_free_block(get_block_size(block), -1);
+}
+
+// Puts newBlock in the place of oldBlock, newBlock must already carry its free header
+void move_block_freeList(void *oldBlock, void *newBlock) {
+    void *prev = get_free_block_prev(oldBlock);
+    void *next = get_free_block_next(oldBlock);
+
+    set_free_block_prev(newBlock, prev);
+    set_free_block_next(newBlock, next);
+    set_free_block_freed_time(newBlock, get_free_block_freed_time(oldBlock));
+
+    if (prev != NULL) {
+        set_free_block_next(prev, newBlock);
+    } else {
+        currentHeap->freeListHead = newBlock;
+    }
+    if (next != NULL) {
+        set_free_block_prev(next, newBlock);
+    } else {
+        currentHeap->freeListTail = newBlock;
+    }
+    if (currentHeap->purgeCursor == oldBlock) {
+        currentHeap->purgeCursor = newBlock;
+    }
+
+    if (currentHeap->freeHeapValid) {
+        free_heap_place(get_free_block_heap_index(oldBlock), newBlock);
+        free_heap_update(newBlock);
+    }
+    tlsf_remove(oldBlock, get_block_size(oldBlock));
+    tlsf_insert(newBlock);
+    set_free_map(oldBlock, false);
+    set_free_map(newBlock, true);
+    count_free_block(get_block_size(oldBlock), -1);
+    count_free_block(get_block_size(newBlock), 1);
+}
+
+// Merges two adjacent free blocks, latterPtr is unlinked and formerPtr grows over it
+void merge_two_free_blocks(void *formerPtr, void *latterPtr) {
+    size_t formerSize = get_block_size(formerPtr);
+    size_t latterSize = get_block_size(latterPtr);
+
+    size_t mergeSize = formerSize + BLOCK_HEADER_SIZE + latterSize;
+
+    // The pages of the merged block go back when the more recently freed half is old enough
+    if (get_free_block_freed_time(latterPtr) > get_free_block_freed_time(formerPtr)) {
+        set_free_block_freed_time(formerPtr, get_free_block_freed_time(latterPtr));
+    }
+    remove_block_freeList(latterPtr);
+    tlsf_remove(formerPtr, formerSize);
+    set_block_header_footer(formerPtr, mergeSize, FREE);
+    tlsf_insert(formerPtr);
+    free_heap_update(formerPtr);
+    count_free_block(formerSize, -1);
+    count_free_block(mergeSize, 1);
+    COUNT(merges, 1);
+
+    currentHeap->totalFreeSize += BLOCK_HEADER_SIZE;
+
+    if (mergeSize > currentHeap->trimThreshold) {
+        trim_top_free_block(formerPtr);
+    }
+}
+
+// Gives the excess of the top free block back to the system, it is left with MAX_TOP_FREE
+void trim_top_free_block(void *block) {
+    size_t topSize = get_block_size(block);
+
+    if (topSize > MAX_TOP_FREE && get_top_free_block() == block) {
+        void *newHeapEnd = block + MAX_TOP_FREE + FENCE_SIZE;
+        // The kernel keeps the page the break ends in, the fence and footer left there must not show up in a later block
+        memset(currentHeap->heapEnd - FENCE_SIZE, 0, FENCE_SIZE);
+        int brkState = set_break(newHeapEnd);
+        if (brkState == 0) {
+            currentHeap->heapShrunkSize += (currentHeap->heapEnd - newHeapEnd);
+            currentHeap->heapEnd = newHeapEnd;
+            currentHeap->isBreakTrimmed = true;
+            set_fence(currentHeap->heapEnd - FENCE_SIZE);
+            tlsf_remove(block, topSize);
+            set_block_header_footer(block, MAX_TOP_FREE, FREE);
+            tlsf_insert(block);
+            free_heap_update(block);
+            count_free_block(topSize, -1);
+            count_free_block(MAX_TOP_FREE, 1);
+            currentHeap->totalFreeSize -= (topSize - MAX_TOP_FREE);
+        }
+        else {
+            set_fence(currentHeap->heapEnd - FENCE_SIZE);
+            set_block_header_footer(block, topSize, FREE);
+        }
+
+        if (IS_DEBUG_MODE) {
+            char str[60];
+            if (brkState == 0) {
+                sprintf(str, "\tbrk() SUCCESS, ret val %d", brkState);
+            } else {
+                sprintf(str, "\tbrk() FAILURE, ret val %d", brkState);
+            }
+            puts(str);
+        }
+    }
+}
+
+// Returns true if block a belongs above block b in the free heap, i.e. worst fit prefers it
+bool free_heap_above(void *a, void *b) {
+    size_t aSize = get_block_size(a);
+    size_t bSize = get_block_size(b);
+
+    return aSize > bSize || (aSize == bSize && a < b);
+}
+
+void free_heap_place(int index, void *block) {
+    currentHeap->freeHeap[index] = block;
+    set_free_block_heap_index(block, index);
+}
+
+void free_heap_sift_up(int index) {
+    void *block = currentHeap->freeHeap[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!free_heap_above(block, currentHeap->freeHeap[parent])) {
+            break;
+        }
+        free_heap_place(index, currentHeap->freeHeap[parent]);
+        index = parent;
+    }
+    free_heap_place(index, block);
+}
+
+void free_heap_sift_down(int index) {
+    void *block = currentHeap->freeHeap[index];
+
+    while (2 * index + 1 < currentHeap->freeHeapCount) {
+        int child = 2 * index + 1;
+        if (child + 1 < currentHeap->freeHeapCount && free_heap_above(currentHeap->freeHeap[child + 1], currentHeap->freeHeap[child])) {
+            child++;
+        }
+        if (!free_heap_above(currentHeap->freeHeap[child], block)) {
+            break;
+        }
+        free_heap_place(index, currentHeap->freeHeap[child]);
+        index = child;
+    }
+    free_heap_place(index, block);
+}
+
+// The free heap lives outside of the program break so it never gets in the way of sbrk
+bool free_heap_grow() {
+    int newCapacity = currentHeap->freeHeapCapacity ? 2 * currentHeap->freeHeapCapacity : FREE_HEAP_INIT_CAPACITY;
+    void **newHeap = mmap(NULL, newCapacity * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (newHeap == MAP_FAILED) {
+        return false;
+    }
+    if (currentHeap->freeHeap != NULL) {
+        memcpy(newHeap, currentHeap->freeHeap, currentHeap->freeHeapCount * sizeof(void *));
+        munmap(currentHeap->freeHeap, currentHeap->freeHeapCapacity * sizeof(void *));
+    }
+    currentHeap->freeHeap = newHeap;
+    currentHeap->freeHeapCapacity = newCapacity;
+
+    return true;
+}
+
+void free_heap_insert(void *block) {
+    if (!currentHeap->freeHeapValid) {
+        return;
+    }
+    if (currentHeap->freeHeapCount == currentHeap->freeHeapCapacity && !free_heap_grow()) {
+        currentHeap->freeHeapValid = false;
+        return;
+    }
+    currentHeap->freeHeapCount++;
+    free_heap_place(currentHeap->freeHeapCount - 1, block);
+    free_heap_sift_up(currentHeap->freeHeapCount - 1);
+}
+
+void free_heap_remove(void *block) {
+    if (!currentHeap->freeHeapValid) {
+        return;
+    }
+    int index = get_free_block_heap_index(block);
+    void *lastBlock = currentHeap->freeHeap[--currentHeap->freeHeapCount];
+
+    if (index < currentHeap->freeHeapCount) {
+        free_heap_place(index, lastBlock);
+        free_heap_update(lastBlock);
+    }
+}
+
+// Restores the heap order around a block whose size or address just changed
+void free_heap_update(void *block) {
+    if (!currentHeap->freeHeapValid) {
+        return;
+    }
+    free_heap_sift_up(get_free_block_heap_index(block));
+    free_heap_sift_down(get_free_block_heap_index(block));
+}
+
+// Puts every free block back in the free heap, after TLSF_FIT or a failure to grow
+void rebuild_free_heap() {
+    currentHeap->freeHeapValid = true;
+    currentHeap->freeHeapCount = 0;
+
+    void *cursor = currentHeap->freeListHead;
+    while (cursor != NULL && currentHeap->freeHeapValid) {
+        free_heap_insert(cursor);
+        cursor = get_free_block_next(cursor);
+    }
+}
+
+// Finds the TLSF list of a size, a first level per power of two and 16 second levels in each
+void get_tlsf_index(size_t size, int *fl, int *sl) {
+    if (size < (1UL << TLSF_FL_SHIFT)) {
+        *fl = 0;
+        *sl = size / ALIGNMENT;
+    }
+    else {
+        int msb = BITS_PER_LONG - 1 - __builtin_clzl(size);
+        *fl = msb - TLSF_FL_SHIFT + 1;
+        *sl = (size >> (msb - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    }
+}
+
+// Returns the head of the first non empty list after the list of size rounded up,
+// so any block found fits without walking a list
+void *get_tlsf_fit_block(size_t size) {
+    int fl, sl;
+
+    if (size >= (1UL << TLSF_FL_SHIFT)) {
+        int msb = BITS_PER_LONG - 1 - __builtin_clzl(size);
+        size += (1UL << (msb - TLSF_SL_LOG2)) - 1;
+    }
+    get_tlsf_index(size, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+
+    unsigned long slMap = currentHeap->tlsfSlBitmap[fl] & (~0UL << sl);
+    if (slMap == 0) {
+        unsigned long flMap = currentHeap->tlsfFlBitmap & (~0UL << (fl + 1));
+        if (flMap == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(flMap);
+        slMap = currentHeap->tlsfSlBitmap[fl];
+    }
+    sl = __builtin_ctzl(slMap);
+
+    return currentHeap->tlsfLists[fl][sl];
+}
+
+void tlsf_insert(void *block) {
+    int fl, sl;
+    get_tlsf_index(get_block_size(block), &fl, &sl);
+    void *head = currentHeap->tlsfLists[fl][sl];
+
+    set_free_block_tlsf_prev(block, NULL);
+    set_free_block_tlsf_next(block, head);
+    if (head != NULL) {
+        set_free_block_tlsf_prev(head, block);
+    }
+    currentHeap->tlsfLists[fl][sl] = block;
+    currentHeap->tlsfFlBitmap |= 1UL << fl;
+    currentHeap->tlsfSlBitmap[fl] |= 1UL << sl;
+}
+
+// size is the one the block was inserted with, its header may already hold a new one
+void tlsf_remove(void *block, size_t size) {
+    int fl, sl;
+    get_tlsf_index(size, &fl, &sl);
+    void *prev = get_free_block_tlsf_prev(block);
+    void *next = get_free_block_tlsf_next(block);
+
+    if (prev != NULL) {
+        set_free_block_tlsf_next(prev, next);
+    } else {
+        currentHeap->tlsfLists[fl][sl] = next;
+    }
+    if (next != NULL) {
+        set_free_block_tlsf_prev(next, prev);
+    }
+    if (currentHeap->tlsfLists[fl][sl] == NULL) {
+        currentHeap->tlsfSlBitmap[fl] &= ~(1UL << sl);
+        if (currentHeap->tlsfSlBitmap[fl] == 0) {
+            currentHeap->tlsfFlBitmap &= ~(1UL << fl);
+        }
+    }
+}
+
+// Runs once the countdown of the thread runs out. While the profiler is off it only sets the countdown again,
+// otherwise the block comes from the free list or a mapping, never from a slab or a thread cache, so its header can carry the mark
+void *allocate_sampled_block(size_t size) {
+    void *stack[PROFILE_MAX_DEPTH + 1];
+    void *ptrMemory = NULL;
+
+    if (!isProfiling) {
+        sampleCountdown = PROFILE_RECHECK_BYTES;
+        return NULL;
+    }
+    sampleCountdown = get_sample_interval();
+    // The frame of this function is left out, the stack starts in sma_malloc
+    int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1) - 1;
+    if (size > MAX_BLOCK_SIZE) {
+        return NULL;
+    }
+    size_t blockSize = align_size(size < FREE_BLOCK_LINKS_SIZE ? FREE_BLOCK_LINKS_SIZE : size);
+
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    if (sampledBlockCount < PROFILE_TABLE_SIZE / 2) {
+        ptrMemory = blockSize > currentHeap->mmapThreshold ? allocate_from_mmap(blockSize) : allocate_block(get_fitting_block_size(size));
+    }
+    if (ptrMemory != NULL) {
+        currentHeap->lastAllocatedPtr = ptrMemory;
+        add_sampled_block(ptrMemory, size, stack + 1, depth);
+    }
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+
+    return ptrMemory;
+}
+
+// Exponential with a mean of profileInterval, -ln(u) from a fast log2 of a 26-bit uniform u
+long get_sample_interval() {
+    if (sampleRandom == 0) {
+        sampleRandom = (unsigned long)&sampleRandom ^ read_timestamp() ^ 0x9E3779B97F4A7C15UL;
+    }
+    sampleRandom ^= sampleRandom << 13;
+    sampleRandom ^= sampleRandom >> 7;
+    sampleRandom ^= sampleRandom << 17;
+
+    // Exponent plus a quadratic fit of the log2 of the mantissa
+    union {
+        double value;
+        unsigned long bits;
+    } u = {(double)((sampleRandom >> 38) + 1)};
+    double exponent = (double)(long)((u.bits >> 52) & 0x7FF) - 1023;
+    u.bits = (u.bits & ((1UL << 52) - 1)) | (1023UL << 52);
+    double log2u = exponent + (-0.34484843 * u.value + 2.02466578) * u.value - 0.67487759;
+
+    return (long)((26 - log2u) * 0.6931471805599453 * profileInterval) + 1;
+}
+
+// Marks a block and puts it in the sample table, smaLock held
+void add_sampled_block(void *ptr, size_t size, void **stack, int depth) {
+    unsigned long index = hash_sampled_block(ptr);
+
+    while (sampleTable[index].ptr != NULL) {
+        index = (index + 1) & (PROFILE_TABLE_SIZE - 1);
+    }
+    sampleTable[index].ptr = ptr;
+    sampleTable[index].size = size;
+    sampleTable[index].depth = depth;
+    memcpy(sampleTable[index].stack, stack, depth * sizeof(void *));
+    *(size_t *)(ptr - sizeof(size_t)) |= SAMPLED;
+    sampledBlockCount++;
+}
+
+// Takes a block out of the sample table and clears its mark, smaLock held.
+// The slots after it that probed past its slot move back, so no lookup stops early
+void forget_sampled_block(void *ptr) {
+    unsigned long index = hash_sampled_block(ptr);
+
+    while (sampleTable[index].ptr != ptr) {
+        index = (index + 1) & (PROFILE_TABLE_SIZE - 1);
+    }
+    unsigned long next = (index + 1) & (PROFILE_TABLE_SIZE - 1);
+    while (sampleTable[next].ptr != NULL) {
+        unsigned long home = hash_sampled_block(sampleTable[next].ptr);
+        if (((next - home) & (PROFILE_TABLE_SIZE - 1)) >= ((next - index) & (PROFILE_TABLE_SIZE - 1))) {
+            sampleTable[index] = sampleTable[next];
+            index = next;
+        }
+        next = (next + 1) & (PROFILE_TABLE_SIZE - 1);
+    }
+    sampleTable[index].ptr = NULL;
+    *(size_t *)(ptr - sizeof(size_t)) &= ~(size_t)SAMPLED;
+    sampledBlockCount--;
+}
+
+// Sampled blocks skip the thread cache, the mark is cleared before the block goes back
+void free_sampled_block(void *ptr) {
+    if (isThreadSafe) {
+        pthread_mutex_lock(&smaLock);
+    }
+    forget_sampled_block(ptr);
+    free_memory(ptr);
+    if (isThreadSafe) {
+        pthread_mutex_unlock(&smaLock);
+    }
+}
+
+bool is_sampled_block(void *ptr) {
+    return !is_slab_object(ptr) && (*(size_t *)(ptr - sizeof(size_t)) & SAMPLED) != 0;
+}
+
+unsigned long hash_sampled_block(void *ptr) {
+    return ((((unsigned long)ptr >> 4) * 0x9E3779B97F4A7C15UL) >> 32) & (PROFILE_TABLE_SIZE - 1);
+}
+
+// Appends a record to the ring of the calling thread, a full ring drops it rather than wait
+void trace_record(unsigned int op, size_t size, void *address, void *result) {
+    TraceBuffer *buffer = threadTraceBuffer;
+
+    if (buffer == NULL && (buffer = register_trace_buffer()) == NULL) {
+        return;
+    }
+    unsigned long head = buffer->head;
+    if (head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) {
+        buffer->dropped++;
+        return;
+    }
+    SmaTraceRecord *record = &buffer->records[head & (TRACE_RING_SIZE - 1)];
+    record->timestamp = read_timestamp();
+    record->size = size;
+    record->address = address;
+    record->result = result;
+    record->threadId = buffer->threadId;
+    record->op = op;
+    // The flusher only reads a record once head has moved past it
+    __atomic_store_n(&buffer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Takes over the ring of a thread that exited, or maps a new one outside of the heap so tracing never calls back into SMA
+TraceBuffer *register_trace_buffer() {
+    pthread_mutex_lock(&traceLock);
+    if (!isTraceBufferKeyCreated) {
+        pthread_key_create(&traceBufferKey, release_trace_buffer);
+        isTraceBufferKeyCreated = true;
+    }
+    // Records the last owner left unflushed stay in the ring, the new owner writes on from its head
+    TraceBuffer *buffer = traceBuffers;
+    while (buffer != NULL && buffer->isOwned) {
+        buffer = buffer->next;
+    }
+    if (buffer == NULL) {
+        size_t mapSize = sizeof(TraceBuffer) + TRACE_RING_SIZE * sizeof(SmaTraceRecord);
+        void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            pthread_mutex_unlock(&traceLock);
+            return NULL;
+        }
+        buffer = (TraceBuffer *)map;
+        buffer->records = (SmaTraceRecord *)(map + sizeof(TraceBuffer));
+        buffer->next = traceBuffers;
+        traceBuffers = buffer;
+    }
+    buffer->isOwned = true;
+    buffer->threadId = syscall(SYS_gettid);
+    pthread_mutex_unlock(&traceLock);
+    threadTraceBuffer = buffer;
+    pthread_setspecific(traceBufferKey, buffer);
+
+    return buffer;
+}
+
+// Runs when a thread that traced exits, so the rings never outnumber the threads alive at once
+void release_trace_buffer(void *buffer) {
+    threadTraceBuffer = NULL;
+    pthread_mutex_lock(&traceLock);
+    ((TraceBuffer *)buffer)->isOwned = false;
+    pthread_mutex_unlock(&traceLock);
+}
+
+void lock_trace_before_fork() {
+    pthread_mutex_lock(&traceLock);
+}
+
+void unlock_trace_after_fork() {
+    pthread_mutex_unlock(&traceLock);
+}
+
+// The flusher isn't copied into the child, and records of another address space would only mislead a replay
+void stop_trace_in_child() {
+    isTracing = false;
+    pthread_mutex_unlock(&traceLock);
+}
+
+void *flush_trace_buffers_loop(void *arg) {
+    struct timespec interval = {0, TRACE_FLUSH_INTERVAL};
+
+    while (__atomic_load_n(&isTracing, __ATOMIC_RELAXED)) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&traceLock);
+        flush_trace_buffers();
+        pthread_mutex_unlock(&traceLock);
+    }
+    return NULL;
+}
+
+// Writes the records of every ring between tail and head to the trace file, traceLock held
+void flush_trace_buffers() {
+    for (TraceBuffer *buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+        unsigned long head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = buffer->tail;
+
+        while (tail != head) {
+            // Up to the end of the ring, the rest wraps around to its start
+            unsigned long index = tail & (TRACE_RING_SIZE - 1);
+            unsigned long count = head - tail < TRACE_RING_SIZE - index ? head - tail : TRACE_RING_SIZE - index;
+            if (write(traceFd, &buffer->records[index], count * sizeof(SmaTraceRecord)) < 0) {
+                break;
+            }
+            tail += count;
+        }
+        __atomic_store_n(&buffer->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Time stamp counter on x86, a few nanoseconds to read, the monotonic clock in nanoseconds elsewhere
+unsigned long long read_timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+// Reads the clock and starts a pass giving back the pages of the blocks free for longer than purgeDelay.
+// A block freed right after a pass started waits at most two delays and the length of a pass
+void purge_expired_blocks() {
+    struct timespec now;
+
+    currentHeap->purgeTick = 0;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    purgeClock = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    if (purgeDelay >= 0 && currentHeap->purgeCursor == NULL && purgeClock - currentHeap->lastPurgeTime >= (unsigned long)purgeDelay) {
+        // The trim threshold halves with every pass the break didn't move up in
+        if (!currentHeap->isHeapGrown && currentHeap->trimThreshold > MAX_TOP_FREE) {
+            currentHeap->trimThreshold = currentHeap->trimThreshold / 2 > MAX_TOP_FREE ? currentHeap->trimThreshold / 2 : MAX_TOP_FREE;
+            void *topBlock = get_top_free_block();
+            if (topBlock != NULL && get_block_size(topBlock) > currentHeap->trimThreshold) {
+                trim_top_free_block(topBlock);
+            }
+        }
+        currentHeap->isHeapGrown = false;
+        currentHeap->purgeCutoff = purgeClock - purgeDelay;
+        currentHeap->purgeCursor = currentHeap->freeListHead;
+        currentHeap->lastPurgeTime = purgeClock;
     }
+}
 
-    int ptrSize = get_block_size(ptr);
+// Carries the pass under way over the next count free blocks, the list unlinks keep purgeCursor on a free block
+void purge_next_free_blocks(int count) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    void *cursor = currentHeap->purgeCursor;
 
-    if (newSize == ptrSize) {
-        return ptr;
-    }
-    else if (newSize < ptrSize) {
-        set_block_header_footer(ptr, newSize, NOT_FREE);
-        int freeBlockSize = ptrSize - newSize - BLOCK_HEADER_SIZE - BLOCK_FOOTER_SIZE;
-        if (freeBlockSize >= 2 * sizeof(char *) + MIN_FREE_BLOCK_SIZE) {
-            void *fakeAllocatedBlock = ptr + newSize + BLOCK_FOOTER_SIZE + BLOCK_HEADER_SIZE;
-            set_block_header_footer(fakeAllocatedBlock, freeBlockSize, NOT_FREE);
-            replace_block_freeList(fakeAllocatedBlock);
-            // Update SMA Info
-            totalAllocatedSize += freeBlockSize;
-            totalFreeSize -= (freeBlockSize + BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
-            totalFreeSize += (ptrSize - newSize);
+    for (; cursor != NULL && count > 0; count--) {
+        unsigned long freedTime = get_free_block_freed_time(cursor);
+        if (freedTime != PURGED_TIME && freedTime <= currentHeap->purgeCutoff) {
+            currentHeap->purgedSize += purge_free_block(cursor, pageSize);
         }
-        else {
-            set_block_header_footer(ptr, ptrSize, NOT_FREE);
-        }
-        // Update SMA Info
-        totalAllocatedSize += (newSize - ptrSize);
-
-        return ptr;
+        cursor = get_free_block_next(cursor);
     }
-    else {
-        char ptrData[ptrSize];
-        memcpy(ptrData, ptr, ptrSize);
+    currentHeap->purgeCursor = cursor;
+}
 
-        replace_block_freeList(ptr);
-        void *newPtr = sma_malloc(newSize);
-        memcpy(newPtr, ptrData, ptrSize);
+// Gives back the pages of the free blocks freed at or before cutoff, walking the free list once.
+// Returns the number of bytes given back
+size_t purge_free_blocks(unsigned long cutoff) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+    void *cursor = currentHeap->freeListHead;
 
-        return newPtr;
+    while (cursor != NULL) {
+        unsigned long freedTime = get_free_block_freed_time(cursor);
+        if (freedTime != PURGED_TIME && freedTime <= cutoff) {
+            released += purge_free_block(cursor, pageSize);
+        }
+        cursor = get_free_block_next(cursor);
     }
+    currentHeap->purgedSize += released;
+
+    return released;
 }
 
-void sma_mallopt(int policy)
-{
-	// Assigns the appropriate Policy
-	if (policy == 1) {
-		currentPolicy = WORST;
-	}
-	else if (policy == 2) {
-		currentPolicy = NEXT;
-        lastAllocatedPtr = NULL;
-	}
+// The whole pages between the links and the end of a free block are dropped,
+// the kernel maps zero pages in when the block is used again
+size_t purge_free_block(void *block, size_t pageSize) {
+    void *pageStart = (void *)(((unsigned long)block + FREE_BLOCK_LINKS_SIZE + pageSize - 1) & ~(pageSize - 1));
+    void *pageEnd = (void *)(((unsigned long)block + get_block_size(block)) & ~(pageSize - 1));
+
+    set_free_block_freed_time(block, PURGED_TIME);
+    if (pageEnd <= pageStart || madvise(pageStart, pageEnd - pageStart, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    return pageEnd - pageStart;
 }
 
-void sma_mallinfo()
-{
-	//	Finds the largest Contiguous Free Space (should be the largest free block)
-	void *largestFreeBlock = get_largest_free_block();
-    int largestFreeBlockSize = get_block_size(largestFreeBlock);
-	char str[60];
+// Reserved in one go, only the pages over the heap in use ever get touched
+bool reserve_free_map() {
+    unsigned long words[FREE_MAP_LEVELS];
+    unsigned long totalWords = 0;
+    unsigned long bits = FREE_MAP_BITS;
 
-	//	Prints the SMA Stats
-	sprintf(str, "Total number of bytes allocated: %lu", totalAllocatedSize);
-	puts(str);
-	sprintf(str, "Total free space: %lu", totalFreeSize);
-	puts(str);
-	sprintf(str, "Size of largest contigious free space (in bytes): %d", largestFreeBlockSize);
-	puts(str);
+    for (int level = 0; level < FREE_MAP_LEVELS; level++) {
+        words[level] = (bits + BITS_PER_LONG - 1) / BITS_PER_LONG;
+        totalWords += words[level];
+        bits = words[level];
+    }
+    unsigned long *map = mmap(NULL, totalWords * sizeof(unsigned long), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    for (int level = 0; level < FREE_MAP_LEVELS; level++) {
+        currentHeap->freeMap[level] = map;
+        map += words[level];
+    }
+
+    return true;
 }
 
-void *allocate_from_sbrk(int size) {
-    char str[60];
-    /*
-    sprintf(str, "\tallocate_from_sbrk: %d", size);
-    puts(str);
-    */
+// Sets the bit of a block entering the free list, or clears it when the block leaves
+void set_free_map(void *block, bool isFree) {
+    if (!currentHeap->freeMapValid) {
+        return;
+    }
+    if (currentHeap->freeMap[0] == NULL && !reserve_free_map()) {
+        currentHeap->freeMapValid = false;
+        return;
+    }
+    unsigned long offset = (unsigned long)(block - currentHeap->heapStart);
+    if (block < currentHeap->heapStart || offset % ALIGNMENT != 0 || offset / ALIGNMENT >= FREE_MAP_BITS) {
+        // Once a free block is missing from the map it can't answer for any other block
+        currentHeap->freeMapValid = false;
+        return;
+    }
 
-    void *newBlock = NULL;
-    void *freeBlock = NULL;
+    unsigned long index = offset / ALIGNMENT;
+    for (int level = 0; level < FREE_MAP_LEVELS; level++) {
+        unsigned long *word = &currentHeap->freeMap[level][index / BITS_PER_LONG];
+        bool wasEmpty = *word == 0;
+        if (isFree) {
+            *word |= (1UL << (index % BITS_PER_LONG));
+        } else {
+            *word &= ~(1UL << (index % BITS_PER_LONG));
+        }
+        // The level above only changes when a word turns empty or stops being empty
+        if (wasEmpty == (*word == 0)) {
+            break;
+        }
+        index /= BITS_PER_LONG;
+    }
+}
 
-    int tailSize = 0;
-    if (freeListHead != NULL) {
-        tailSize = freeListTail ? get_block_size(freeListTail) : get_block_size(freeListHead);
+// Climbs until a word has a bit below the index, then follows the highest bits back down
+void *find_free_map_prev(unsigned long index) {
+    int level = 0;
+
+    while (true) {
+        unsigned long word = index / BITS_PER_LONG;
+        unsigned long below = currentHeap->freeMap[level][word] & ((1UL << (index % BITS_PER_LONG)) - 1);
+        if (below != 0) {
+            index = word * BITS_PER_LONG + (BITS_PER_LONG - 1 - __builtin_clzl(below));
+            break;
+        }
+        if (level == FREE_MAP_LEVELS - 1) {
+            return NULL;
+        }
+        index = word;
+        level++;
     }
-    int excessSize = MAX_TOP_FREE;
-    if (tailSize > 0) {  // freeListHead != NULL
-        excessSize += (size - tailSize);
-        totalFreeSize += (MAX_TOP_FREE - tailSize);
-    } else {
-        // Update SMA Info
-        totalFreeSize = MAX_TOP_FREE;
+    while (level > 0) {
+        level--;
+        index = index * BITS_PER_LONG + (BITS_PER_LONG - 1 - __builtin_clzl(currentHeap->freeMap[level][index]));
     }
-    // Update SMA Info
-    totalAllocatedSize += size;
 
-    void *sbrkHead = sbrk(2 * BLOCK_HEADER_SIZE + 2 * BLOCK_FOOTER_SIZE + size + excessSize);
+    return currentHeap->heapStart + index * ALIGNMENT;
+}
+
+void *allocate_small_block(size_t size) {
+    int sizeClass = size > 0 ? (size - 1) / SIZE_CLASS_STEP : 0;
+    Slab *slab = currentHeap->smallBins[sizeClass];
 
-    if (tailSize > 0) {
-        if (freeListTail == NULL) {
-            newBlock = freeListHead;
-            freeListHead = NULL;
-        } else {
-            newBlock = freeListTail;
-            void *tailPrev = get_free_block_prev(freeListTail);
-            if (tailPrev == freeListHead) {
-                freeListTail = NULL;
-            } else {
-                freeListTail = tailPrev;
-            }
+    if (slab == NULL) {
+        slab = get_free_slab();
+        if (slab == NULL) {
+            return NULL;
         }
+        slab->objectSize = (sizeClass + 1) * SIZE_CLASS_STEP;
+        slab->freeObjects = NULL;
+        slab->unusedObjects = (char *)slab + SLAB_HEADER_SIZE;
+        slab->usedObjects = 0;
+        slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->objectSize;
+        slab->cache = NULL;
+        push_slab(&currentHeap->smallBins[sizeClass], slab);
+    }
+
+    void *object = NULL;
+    if (slab->freeObjects != NULL) {
+        object = slab->freeObjects;
+        slab->freeObjects = *(void **)object;
     }
     else {
-        newBlock = sbrkHead + BLOCK_HEADER_SIZE;
+        object = slab->unusedObjects;
+        slab->unusedObjects += slab->objectSize;
     }
+    slab->usedObjects++;
 
-    set_block_header_footer(newBlock, size, NOT_FREE);
+    // A full slab leaves its bin until one of its objects comes back
+    if (slab->usedObjects == slab->capacity) {
+        unlink_slab(&currentHeap->smallBins[sizeClass], slab);
+    }
 
-    freeBlock = newBlock + size + BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE;
-    set_block_header_footer(freeBlock, MAX_TOP_FREE, FREE);
-    append_block_freeList(freeBlock);
+    // Update SMA Info
+    currentHeap->totalAllocatedSize += slab->objectSize;
+    currentHeap->slabInUseSize += slab->objectSize;
 
-    return newBlock;
+    return object;
 }
 
-void *allocate_from_freeList(int size) {
-	void *newBlock = NULL;
+void free_small_block(void *ptr) {
+    Slab *slab = get_slab(ptr);
+    int sizeClass = slab->objectSize / SIZE_CLASS_STEP - 1;
 
-    if (currentPolicy == WORST) {
-		newBlock = allocate_worst_fit(size);
+    if (slab->usedObjects == slab->capacity) {
+        push_slab(&currentHeap->smallBins[sizeClass], slab);
     }
-    else if (currentPolicy == NEXT) {
-        newBlock = allocate_next_fit(size);
+    *(void **)ptr = slab->freeObjects;
+    slab->freeObjects = ptr;
+    slab->usedObjects--;
+    currentHeap->slabInUseSize -= slab->objectSize;
+
+    // An empty slab goes back unless it is the last one of its size class,
+    // so a single object freed and allocated in a loop doesn't bounce a slab around
+    if (slab->usedObjects == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        unlink_slab(&currentHeap->smallBins[sizeClass], slab);
+        release_slab(slab);
+    }
+}
+
+Slab *get_free_slab() {
+    if (currentHeap->freeSlabList == NULL && !allocate_superblock()) {
+        return NULL;
     }
+    Slab *slab = currentHeap->freeSlabList;
+    unlink_slab(&currentHeap->freeSlabList, slab);
+    slab->superblock->freeSlabs--;
 
-    return newBlock;
+    return slab;
 }
 
-void *allocate_worst_fit(int size) {
-    void *newBlock = NULL;
-    void *largestFreeBlock = get_largest_free_block();
+// Carves SLABS_PER_SUPERBLOCK aligned slabs out of one ordinary block
+bool allocate_superblock() {
+    Superblock *superblock = allocate_block(SUPERBLOCK_SIZE);
+    if (superblock == NULL) {
+        return false;
+    }
 
-    if (largestFreeBlock != NULL) {
-        newBlock = allocate_block_from_freeList(largestFreeBlock, size);
+    unsigned long firstSlab = (unsigned long)superblock + SUPERBLOCK_HEADER_SIZE;
+    firstSlab = (firstSlab + SLAB_SIZE - 1) & ~(unsigned long)(SLAB_SIZE - 1);
+    superblock->firstSlab = (Slab *)firstSlab;
+    superblock->freeSlabs = SLABS_PER_SUPERBLOCK;
+    currentHeap->superblockSize += get_block_size(superblock);
+
+    if (!set_slab_map(superblock->firstSlab, true)) {
+        currentHeap->superblockSize -= get_block_size(superblock);
+        replace_block_freeList(superblock);
+        return false;
+    }
+    for (int i = 0; i < SLABS_PER_SUPERBLOCK; i++) {
+        Slab *slab = (Slab *)(firstSlab + i * SLAB_SIZE);
+        slab->superblock = superblock;
+        push_slab(&currentHeap->freeSlabList, slab);
     }
 
-    return newBlock;
+    return true;
 }
 
-void *allocate_next_fit(int size) {
-    void *newBlock = NULL;
-    void *nextFreeBlock = get_next_fit_block(size);
+// Returns a slab to the free slab list, and its superblock to the free list once all of its slabs are back
+void release_slab(Slab *slab) {
+    Superblock *superblock = slab->superblock;
 
-    if (nextFreeBlock != NULL) {
-        newBlock = allocate_block_from_freeList(nextFreeBlock, size);
+    push_slab(&currentHeap->freeSlabList, slab);
+    superblock->freeSlabs++;
+
+    if (superblock->freeSlabs == SLABS_PER_SUPERBLOCK) {
+        for (int i = 0; i < SLABS_PER_SUPERBLOCK; i++) {
+            unlink_slab(&currentHeap->freeSlabList, (Slab *)((char *)superblock->firstSlab + i * SLAB_SIZE));
+        }
+        set_slab_map(superblock->firstSlab, false);
+        currentHeap->superblockSize -= get_block_size(superblock);
+        replace_block_freeList(superblock);
     }
+}
 
-    return newBlock;
+void push_slab(Slab **list, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
 }
 
-void *allocate_block_from_freeList(void *freeBlock, int newBlockSize) {
-    int freeBlockSize = get_block_size(freeBlock);
+void unlink_slab(Slab **list, Slab *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = NULL;
+    slab->next = NULL;
+}
 
-    if (freeBlockSize < newBlockSize) {
-        return NULL;
+// Marks or clears the windows of the slabs of one superblock
+bool set_slab_map(Slab *firstSlab, bool isSlab) {
+    // Reserved in one go so that threads reading it without the lock never see it move
+    if (currentHeap->slabMap == NULL) {
+        currentHeap->slabMap = mmap(NULL, SLAB_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (currentHeap->slabMap == MAP_FAILED) {
+            currentHeap->slabMap = NULL;
+            return false;
+        }
+        currentHeap->slabMapBits = 8 * SLAB_MAP_SIZE;
     }
 
-    void *freePrev = get_free_block_prev(freeBlock);
-    void *freeNext = get_free_block_next(freeBlock);
+    unsigned long firstIndex = get_slab_map_index(firstSlab);
+    if (firstIndex + SLABS_PER_SUPERBLOCK > currentHeap->slabMapBits) {
+        return false;
+    }
+    for (unsigned long index = firstIndex; index < firstIndex + SLABS_PER_SUPERBLOCK; index++) {
+        if (isSlab) {
+            currentHeap->slabMap[index / BITS_PER_LONG] |= (1UL << (index % BITS_PER_LONG));
+        } else {
+            currentHeap->slabMap[index / BITS_PER_LONG] &= ~(1UL << (index % BITS_PER_LONG));
+        }
+    }
 
-    void *newBlock = freeBlock;
-    void *newFreeBlock = NULL;
+    return true;
+}
+
+unsigned long get_slab_map_index(void *ptr) {
+    unsigned long slabMapBase = (unsigned long)currentHeap->heapStart & ~(unsigned long)(SLAB_SIZE - 1);
 
-    set_block_header_footer(newBlock, newBlockSize, NOT_FREE);
+    return ((unsigned long)ptr - slabMapBase) / SLAB_SIZE;
+}
 
-    int newFreeBlockSize = freeBlockSize - newBlockSize - BLOCK_FOOTER_SIZE - BLOCK_HEADER_SIZE;
+bool is_slab_object(void *ptr) {
+    if (currentHeap->slabMap == NULL || ptr < currentHeap->heapStart) {
+        return false;
+    }
+    unsigned long index = get_slab_map_index(ptr);
 
-    if (newFreeBlockSize >= 2 * sizeof(char *) + MIN_FREE_BLOCK_SIZE) {
-        newFreeBlock = freeBlock + newBlockSize + BLOCK_FOOTER_SIZE + BLOCK_HEADER_SIZE;
-        set_free_block_prev(newFreeBlock, freePrev);
-        set_free_block_next(newFreeBlock, freeNext);
+    return index < currentHeap->slabMapBits && (currentHeap->slabMap[index / BITS_PER_LONG] >> (index % BITS_PER_LONG)) & 1;
+}
 
-        set_free_block_next(freePrev, newFreeBlock);
-        set_free_block_prev(freeNext, newFreeBlock);
+Slab *get_slab(void *ptr) {
+    return (Slab *)((unsigned long)ptr & ~(unsigned long)(SLAB_SIZE - 1));
+}
 
-        if (freeListHead == freeBlock) {
-            freeListHead = newFreeBlock;
-        }
-        else if (freeListTail == freeBlock) {
-            freeListTail = newFreeBlock;
-        }
-        set_block_header_footer(newFreeBlock, newFreeBlockSize, FREE);
-        
-        totalFreeSize -= (newBlockSize + BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
+// Bytes the caller may use at ptr, whether it is an ordinary block or a slab object
+size_t get_usable_size(void *ptr) {
+    if (is_slab_object(ptr)) {
+        return get_slab(ptr)->objectSize;
     }
-    else {
-        set_block_header_footer(newBlock, freeBlockSize, NOT_FREE);
+    return is_mmapped_block(ptr) ? get_block_size(ptr) : get_block_size(ptr) + LENT_FOOTER_SIZE;
+}
 
-        if (freeListHead == freeBlock) {
-            freeListHead = NULL;
-        }
-        else if (freeListTail == freeBlock) {
-            freeListTail = NULL;
-            set_free_block_next(freeListHead, NULL);
-        }
-        else {
-            set_free_block_prev(freeNext, freePrev);
-            set_free_block_next(freePrev, freeNext);
+void *allocate_cache_object(ObjectCache *cache) {
+    Slab *slab = cache->partialSlabs;
+
+    if (slab != NULL) {
+        cache->hits++;
+    }
+    else {
+        slab = allocate_cache_slab(cache);
+        if (slab == NULL) {
+            return NULL;
         }
+        cache->misses++;
+    }
+
+    unsigned char *freeStack = (unsigned char *)slab + SLAB_HEADER_SIZE;
+    int freeCount = slab->capacity - slab->usedObjects;
+    void *object = get_cache_objects(slab) + freeStack[freeCount - 1] * slab->objectSize;
+    slab->usedObjects++;
 
-        totalFreeSize -= freeBlockSize;
+    if (slab->usedObjects == slab->capacity) {
+        unlink_slab(&cache->partialSlabs, slab);
+        push_slab(&cache->fullSlabs, slab);
     }
 
     // Update SMA Info
-    totalAllocatedSize += newBlockSize;
+    currentHeap->totalAllocatedSize += slab->objectSize;
+    currentHeap->slabInUseSize += slab->objectSize;
+    cache->objectsInUse++;
 
-    return newBlock;
+    return object;
 }
 
-void *get_largest_free_block() {
-    if (freeListHead == NULL) {
-        return NULL;
-    }
-    void *cursor = freeListHead;
-    void *largestFreeBlock = cursor;
-    int cursorSize = 0;
-    int largestFreeBlockSize = 0;
+void free_cache_object(void *ptr) {
+    Slab *slab = get_slab(ptr);
+    ObjectCache *cache = slab->cache;
 
-    while (cursor != NULL) {
-        cursorSize = get_block_size(cursor);
-        if (cursorSize > largestFreeBlockSize) {
-            largestFreeBlockSize = cursorSize;
-            largestFreeBlock = cursor;
-        }
-        cursor = get_free_block_next(cursor);
+    if (slab->usedObjects == slab->capacity) {
+        unlink_slab(&cache->fullSlabs, slab);
+        push_slab(&cache->partialSlabs, slab);
     }
+    unsigned char *freeStack = (unsigned char *)slab + SLAB_HEADER_SIZE;
+    int freeCount = slab->capacity - slab->usedObjects;
+    freeStack[freeCount] = ((char *)ptr - get_cache_objects(slab)) / slab->objectSize;
+    slab->usedObjects--;
 
-    return largestFreeBlock;
+    currentHeap->slabInUseSize -= slab->objectSize;
+    cache->objectsInUse--;
+
+    // Like a size class slab, an empty slab goes back unless it is the last one with free objects
+    if (slab->usedObjects == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        release_cache_slab(slab);
+    }
 }
 
-void *get_next_fit_block(int newBlockSize) {
-    if (freeListHead == NULL) {
+// Takes a slab and constructs all of its objects at once
+Slab *allocate_cache_slab(ObjectCache *cache) {
+    Slab *slab = get_free_slab();
+    if (slab == NULL) {
         return NULL;
     }
-    void *cursorPtr = freeListHead;
-    void *nextFreeBlock = NULL, *restartFreeBlock = NULL;
-    int cursorSize;
+    slab->objectSize = cache->objectSize;
+    slab->capacity = cache->capacity;
+    slab->usedObjects = 0;
+    slab->freeObjects = NULL;
+    slab->unusedObjects = NULL;
+    slab->cache = cache;
+
+    unsigned char *freeStack = (unsigned char *)slab + SLAB_HEADER_SIZE;
+    for (int i = 0; i < slab->capacity; i++) {
+        // The lowest addresses are handed out first
+        freeStack[i] = slab->capacity - 1 - i;
+        if (cache->ctor != NULL) {
+            cache->ctor(get_cache_objects(slab) + i * slab->objectSize);
+        }
+    }
+    push_slab(&cache->partialSlabs, slab);
+    cache->slabCount++;
 
-    while (cursorPtr != NULL) {
-        cursorSize = get_block_size(cursorPtr);
+    return slab;
+}
 
-        if (restartFreeBlock == NULL && cursorSize >= newBlockSize && cursorPtr < lastAllocatedPtr) {
-            restartFreeBlock = cursorPtr;
-        }
-        if (nextFreeBlock == NULL && cursorSize >= newBlockSize && cursorPtr >= lastAllocatedPtr) {
-            nextFreeBlock = cursorPtr;
-            break;
+// Destructs the free objects of a slab and gives it back to the free slab list
+void release_cache_slab(Slab *slab) {
+    ObjectCache *cache = slab->cache;
+    unsigned char *freeStack = (unsigned char *)slab + SLAB_HEADER_SIZE;
+
+    if (cache->dtor != NULL) {
+        for (int i = 0; i < slab->capacity - slab->usedObjects; i++) {
+            cache->dtor(get_cache_objects(slab) + freeStack[i] * slab->objectSize);
         }
-        cursorPtr = get_free_block_next(cursorPtr);
     }
+    currentHeap->slabInUseSize -= slab->usedObjects * slab->objectSize;
+    cache->objectsInUse -= slab->usedObjects;
 
-    char str[100];
-    if (IS_DEBUG_MODE) {
-        sprintf(str, "\tlastAllocatedPtr %p, nextFreeBlock %p, restartFreeBlock %p", lastAllocatedPtr, nextFreeBlock, restartFreeBlock);
-        puts(str);
-    }
+    unlink_slab(slab->usedObjects == slab->capacity ? &cache->fullSlabs : &cache->partialSlabs, slab);
+    cache->slabCount--;
+    slab->cache = NULL;
+    release_slab(slab);
+}
 
-    return nextFreeBlock ? nextFreeBlock : restartFreeBlock;
+char *get_cache_objects(Slab *slab) {
+    return (char *)slab + SLAB_HEADER_SIZE + align_size(slab->capacity);
 }
 
-// Replace allocated ptr to free ptr
-void replace_block_freeList(void *ptr) {
-    char str[120];
-    /*
-    sprintf(str, "replace_block_freeList ptr %p", ptr);
-    puts(str);
-    */
+// Pops a block of this thread's cache, refilling the bin from the central free list when it is empty
+void *allocate_from_thread_cache(size_t size) {
+    if (size > THREAD_CACHE_MAX_SIZE) {
+        return NULL;
+    }
+    int bin = size > 0 ? (size - 1) / SIZE_CLASS_STEP : 0;
+
+    if (threadCache.counts[bin] == 0 && !refill_thread_cache(bin)) {
+        return NULL;
+    }
+    void *block = threadCache.bins[bin];
+    threadCache.bins[bin] = *(void **)block;
+    threadCache.counts[bin]--;
 
-    int ptrSize = get_block_size(ptr);
+    return block;
+}
 
-    if (freeListHead == NULL) {
-        set_block_header_footer(ptr, ptrSize, FREE);
-        set_free_block_prev(ptr, NULL);
-        set_free_block_next(ptr, NULL);
-        freeListHead = ptr;
+// Keeps a block in this thread's cache, returns false if it is too large to be cached.
+// usableSize may be less than the block holds, the block then goes to a lower bin
+bool free_to_thread_cache(void *ptr, size_t usableSize) {
+    // Objects of an object cache go back to their cache in their constructed state
+    if (is_slab_object(ptr) && get_slab(ptr)->cache != NULL) {
+        return false;
     }
-    else {
-        if (ptr < freeListHead) {
-            if ((ptr + ptrSize + BLOCK_FOOTER_SIZE + BLOCK_HEADER_SIZE) == freeListHead) {
-                merge_two_free_blocks(ptr, freeListHead);
-            } else {
-                set_block_header_footer(ptr, ptrSize, FREE);
-                set_free_block_prev(ptr, NULL);
-                set_free_block_next(ptr, freeListHead);
-                set_free_block_prev(freeListHead, ptr);
-                freeListTail = freeListHead;
-                freeListHead = ptr;
-            }
-        }
-        else {
-            int prevBlockTag = *(int *)(ptr - BLOCK_HEADER_SIZE - BLOCK_FOOTER_SIZE);
-            if (freeListTail == NULL) {
-                if (prevBlockTag == FREE) {
-                    merge_two_free_blocks(freeListHead, ptr);
-                } else {
-                    set_block_header_footer(ptr, ptrSize, FREE);
-                    set_free_block_prev(ptr, freeListHead);
-                    set_free_block_next(freeListHead, ptr);
-                    freeListTail = ptr;
-                }
-            }
-            else {
-                if (ptr < freeListTail) {
-                    void *freeCursor = freeListHead;
-                    void *freeCursorNext = get_free_block_next(freeCursor);
-                    while (freeCursor != NULL && freeCursorNext != NULL) {
-                        if (freeCursor < ptr && ptr < freeCursorNext) {
-                            int nextBlockTag = *(int *)(ptr + ptrSize + BLOCK_FOOTER_SIZE);
-
-                            if (nextBlockTag == FREE) {
-                                merge_two_free_blocks(ptr, freeCursorNext);
-                            }
-                            if (prevBlockTag == FREE) {
-                                merge_two_free_blocks(freeCursor, ptr);
-                            } 
-                            if (nextBlockTag == NOT_FREE && prevBlockTag == NOT_FREE) {
-                                set_block_header_footer(ptr, ptrSize, FREE);
-
-                                set_free_block_prev(freeCursorNext, ptr);
-                                set_free_block_prev(ptr, freeCursor);
-                                set_free_block_next(freeCursor, ptr);
-                                set_free_block_next(ptr, freeCursorNext);
-                            }
-                            break;
-                        }
-                        freeCursor = freeCursorNext;
-                        freeCursorNext = get_free_block_next(freeCursorNext);
-                    }
-                } else {
-                    if (prevBlockTag == FREE) {
-                        merge_two_free_blocks(freeListTail, ptr);
-                    } else {
-                        set_free_block_next(freeListTail, ptr);
-                        set_free_block_prev(ptr, freeListTail);
-                        freeListTail = ptr;
-                    }
-                }
-            }
-        }
+    if (usableSize > THREAD_CACHE_MAX_SIZE) {
+        return false;
     }
-    // Update SMA Info
-    totalFreeSize += ptrSize;
+    // Every block of a bin can serve any request of that bin
+    int bin = usableSize / SIZE_CLASS_STEP - 1;
+
+    if (threadCache.counts[bin] == THREAD_CACHE_BIN_CAPACITY) {
+        flush_thread_cache(&threadCache, bin, THREAD_CACHE_BIN_CAPACITY / 2);
+    }
+    register_thread_cache();
+    *(void **)ptr = threadCache.bins[bin];
+    threadCache.bins[bin] = ptr;
+    threadCache.counts[bin]++;
+
+    return true;
 }
 
-void append_block_freeList(void *ptr) {
-    int ptrSize = get_block_size(ptr);
-    set_block_header_footer(ptr, ptrSize, FREE);
+bool refill_thread_cache(int bin) {
+    register_thread_cache();
 
-    if (freeListHead == NULL) {
-        freeListHead = ptr;
-        set_free_block_prev(ptr, NULL);
-        set_free_block_next(ptr, NULL);
-    }
-    else {
-        if (freeListTail == NULL) {
-            set_free_block_prev(ptr, freeListHead);
-            set_free_block_next(ptr, NULL);
-            set_free_block_next(freeListHead, ptr);
-        } else {
-            set_free_block_prev(ptr, freeListTail);
-            set_free_block_next(ptr, NULL);
-            set_free_block_next(freeListTail, ptr);
+    pthread_mutex_lock(&smaLock);
+    for (int i = 0; i < THREAD_CACHE_REFILL_COUNT; i++) {
+        void *block = allocate_memory((bin + 1) * SIZE_CLASS_STEP);
+        if (block == NULL) {
+            break;
         }
-        freeListTail = ptr;
+        *(void **)block = threadCache.bins[bin];
+        threadCache.bins[bin] = block;
+        threadCache.counts[bin]++;
     }
+    pthread_mutex_unlock(&smaLock);
+
+    return threadCache.counts[bin] > 0;
 }
 
-void merge_two_free_blocks(void *formerPtr, void *latterPtr) {    
-    int formerSize = get_block_size(formerPtr);
-    int latterSize = get_block_size(latterPtr);
-    int latterTag = *(int *)(latterPtr - BLOCK_HEADER_SIZE);
+// Gives count blocks of a bin back to the central free list under one lock
+void flush_thread_cache(ThreadCache *cache, int bin, int count) {
+    pthread_mutex_lock(&smaLock);
+    while (count > 0 && cache->counts[bin] > 0) {
+        void *block = cache->bins[bin];
+        cache->bins[bin] = *(void **)block;
+        cache->counts[bin]--;
+        free_memory(block);
+        count--;
+    }
+    pthread_mutex_unlock(&smaLock);
+}
 
-    int mergeSize = formerSize + BLOCK_FOOTER_SIZE + BLOCK_HEADER_SIZE + latterSize;
+void lock_before_fork() {
+    pthread_mutex_lock(&smaLock);
+}
 
-    set_block_header_footer(formerPtr, mergeSize, FREE);
+void unlock_after_fork() {
+    pthread_mutex_unlock(&smaLock);
+}
 
-    if (latterTag == FREE) {
-        void *latterPrev = get_free_block_prev(latterPtr);
-        void *latterNext = get_free_block_next(latterPtr);
+void register_thread_cache() {
+    if (!threadCache.isRegistered) {
+        pthread_setspecific(threadCacheKey, &threadCache);
+        threadCache.isRegistered = true;
+    }
+}
 
-        if (latterPrev != NULL) {
-            set_free_block_next(latterPrev, formerPtr);
-        }
-        set_free_block_next(formerPtr, latterNext);
+// Empties the cache of an exiting thread. A block a later TLS destructor frees registers the cache
+// again, and the destructors then run one more round to flush it
+void flush_thread_cache_on_exit(void *cache) {
+    ThreadCache *exitingCache = cache;
 
-        if (latterNext != NULL) {
-            set_free_block_prev(latterNext, formerPtr);
-        }
-        set_free_block_prev(formerPtr, latterPrev);
-        
-    }
-    
-    if (latterPtr == freeListHead) {
-        freeListHead = formerPtr;
-    }
-    else if (latterPtr == freeListTail) {
-        freeListTail = formerPtr;
+    for (int bin = 0; bin < THREAD_CACHE_BIN_COUNT; bin++) {
+        flush_thread_cache(exitingCache, bin, exitingCache->counts[bin]);
     }
+    exitingCache->isRegistered = false;
+}
 
-    totalFreeSize += (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE);
+// Keeps the free block count and histogram in step with the free list
+void count_free_block(size_t size, int delta) {
+    int bin = 0;
+    while (bin < SMA_FREE_HISTOGRAM_BINS - 1 && size >= ((size_t)64 << bin)) {
+        bin++;
+    }
+    currentHeap->freeBlockCount += delta;
+    currentHeap->freeBlockHistogram[bin] += delta;
+}
 
-    if (mergeSize > MAX_TOP_FREE) {
-        set_block_header_footer(formerPtr, MAX_TOP_FREE, FREE);
-        int brkState = brk(sbrk(0) - (mergeSize - MAX_TOP_FREE));
-        if (brkState == 0) {
-            totalFreeSize -= (mergeSize - MAX_TOP_FREE);
-        }
+#ifndef SMA_NO_COUNTERS
+int get_walk_bin(size_t visits) {
+    int bin = visits == 0 ? 0 : BITS_PER_LONG - __builtin_clzl(visits);
 
-        if (IS_DEBUG_MODE) {
-            char str[60];
-            if (brkState == 0) {
-                sprintf(str, "\tbrk() SUCCESS, ret val %d", brkState);
-            } else {
-                sprintf(str, "\tbrk() FAILURE, ret val %d", brkState);
-            }
-            puts(str);
-        }
+    return bin < SMA_WALK_HISTOGRAM_BINS - 1 ? bin : SMA_WALK_HISTOGRAM_BINS - 1;
+}
+#endif
+
+// Only a free block has a footer, it is the first word of the header of the next block.
+// The block keeps its PREV_IN_USE bit and passes its own state on to the next block
+void set_block_header_footer(void *block, size_t size, size_t tag) {
+    size_t *header = (size_t *)(block - sizeof(size_t));
+    size_t *nextHeader = (size_t *)(block + size + sizeof(size_t));
+
+    *header = size | tag | (*header & PREV_IN_USE);
+    if (tag == FREE) {
+        *(size_t *)(block + size) = size;
+        *nextHeader &= ~(size_t)PREV_IN_USE;
+    } else {
+        *nextHeader |= PREV_IN_USE;
     }
 }
 
-void set_block_header_footer(void *block, int size, int tag) {
-    // header
-    *(int *)(block - 2 * sizeof(int)) = tag;
-    *(int *)(block - sizeof(int)) = size;
-    // footer
-    *(int *)(block + size) = tag;
-    *(int *)(block + size + sizeof(int)) = size;
+// A fence reads as a zero-length allocated block from both sides so no merge crosses it
+void set_fence(void *ptr) {
+    *(size_t *)(ptr + sizeof(size_t)) = NOT_FREE | PREV_IN_USE;
 }
 
 void set_free_block_prev(void *block, void *prev) {
@@ -525,13 +3123,50 @@ void set_free_block_next(void *block, void *next) {
     }
 }
 
-int get_block_size(void *ptr) {
+void set_free_block_heap_index(void *block, int index) {
+    *(long *)(block + 2 * sizeof(char *)) = index;
+}
+
+void set_free_block_tlsf_prev(void *block, void *prev) {
+    *(char **)(block + 3 * sizeof(char *)) = (char *)prev;
+}
+
+void set_free_block_tlsf_next(void *block, void *next) {
+    *(char **)(block + 4 * sizeof(char *)) = (char *)next;
+}
+
+void set_free_block_freed_time(void *block, unsigned long time) {
+    *(unsigned long *)(block + 5 * sizeof(char *)) = time;
+}
+
+size_t get_block_size(void *ptr) {
     if (ptr == NULL) {
-        return -1;
+        return 0;
     }
-    int *ptrSize = (int *)ptr;
+    size_t *ptrSize = (size_t *)ptr;
     ptrSize--;
-    return *(int *)ptrSize;
+    return *(size_t *)ptrSize & ~(size_t)BLOCK_STATE_BITS;
+}
+
+size_t get_block_tag(void *ptr) {
+    return *(size_t *)(ptr - sizeof(size_t)) & BLOCK_TAG_BITS;
+}
+
+bool is_prev_block_free(void *ptr) {
+    return (*(size_t *)(ptr - sizeof(size_t)) & PREV_IN_USE) == 0;
+}
+
+// Rounds a request up to the next multiple of ALIGNMENT
+size_t align_size(size_t size) {
+    return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+// Length of a block of the free list that holds size bytes once allocated, with the footer slot after it.
+// It must still hold the links of a free block once it is returned
+size_t get_fitting_block_size(size_t size) {
+    size = align_size(size > LENT_FOOTER_SIZE ? size - LENT_FOOTER_SIZE : 0);
+
+    return size < FREE_BLOCK_LINKS_SIZE ? FREE_BLOCK_LINKS_SIZE : size;
 }
 
 void *get_free_block_prev(void *ptr) {
@@ -547,22 +3182,38 @@ void *get_free_block_next(void *ptr) {
     return *(char **)ptrNext;
 }
 
+int get_free_block_heap_index(void *ptr) {
+    return (int)*(long *)(ptr + 2 * sizeof(char *));
+}
+
+void *get_free_block_tlsf_prev(void *ptr) {
+    return *(char **)(ptr + 3 * sizeof(char *));
+}
+
+void *get_free_block_tlsf_next(void *ptr) {
+    return *(char **)(ptr + 4 * sizeof(char *));
+}
+
+unsigned long get_free_block_freed_time(void *ptr) {
+    return *(unsigned long *)(ptr + 5 * sizeof(char *));
+}
+
 void debug() {
     char str[120];
 
     sprintf(str, "\n------- FreeListDebug -------");
     puts(str);
 
-    void *cursor = freeListHead;
-    int totalFreeListSize = 0;
+    void *cursor = currentHeap->freeListHead;
+    size_t totalFreeListSize = 0;
     while (cursor != NULL) {
-        if (cursor == freeListHead) {
-            sprintf(str, "\t%p size %d >>> freeListHead", cursor, get_block_size(cursor));
-        } else if (cursor == freeListTail) {
-            sprintf(str, "\t%p size %d >>> freeListTail", cursor, get_block_size(cursor));
+        if (cursor == currentHeap->freeListHead) {
+            sprintf(str, "\t%p size %zu >>> currentHeap->freeListHead", cursor, get_block_size(cursor));
+        } else if (cursor == currentHeap->freeListTail) {
+            sprintf(str, "\t%p size %zu >>> currentHeap->freeListTail", cursor, get_block_size(cursor));
         } else {
-            sprintf(str, "\t%p size %d", cursor, get_block_size(cursor));
-        }        
+            sprintf(str, "\t%p size %zu", cursor, get_block_size(cursor));
+        }
         puts(str);
 
         totalFreeListSize += get_block_size(cursor);
@@ -570,6 +3221,6 @@ void debug() {
         cursor = get_free_block_next(cursor);
     }
 
-    sprintf(str, "\n\tTotalFreeListSize %d\n", totalFreeListSize);
+    sprintf(str, "\n\tTotalFreeListSize %zu\n", totalFreeListSize);
     puts(str);
 }
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -6,36 +7,284 @@
 //  Policies definition
 #define WORST_FIT	1
 #define NEXT_FIT	2
+#define SEGREGATED_FIT	3  // size-class slabs for requests up to 256 bytes, worst fit above
+#define TLSF_FIT	4  // two-level segregated fit, malloc and free in bounded time
+
+//  Options definition
+#define THREAD_SAFE_MODE	16  // lock the allocator and cache freed blocks per thread, set before starting threads
+#define MMAP_THRESHOLD	17  // followed by a size_t, larger requests are mapped and unmapped on their own (default 128 KB)
+#define PURGE_DELAY	18  // followed by milliseconds, free pages unused that long are given back (default 10 s, negative never)
+
+//  Statistics
+#define SMA_FREE_HISTOGRAM_BINS	16  // bin 0 counts the free blocks below 64 bytes, bin i those of 2^(i+5) up to 2^(i+6) bytes, the last bin all from 1 MB on
+
+typedef struct __SmaStats {
+    size_t allocatedBytes;            //    Bytes handed out since the start, as printed by sma_mallinfo
+    size_t bytesInUse;                //    Bytes of the blocks handed out and not freed yet, or sitting in a thread cache
+    size_t freeBytes;                 //    Bytes of the blocks in the free list
+    size_t largestFreeBlock;
+    size_t freeBlockCount;
+    size_t freeBlockHistogram[SMA_FREE_HISTOGRAM_BINS];
+    double externalFragmentation;     //    1 - largestFreeBlock / freeBytes, 0 when nothing is free
+    size_t overheadBytes;             //    Headers, footers, fences and alignment padding
+    size_t heapGrownBytes;            //    Bytes the program break was moved up by, since the start
+    size_t heapShrunkBytes;           //    Bytes given back to the system by moving the program break down
+    size_t breakCalls;                //    Calls to sbrk and brk that tried to move the program break
+    size_t purgedBytes;               //    Bytes of free pages given back with madvise, since the start
+} SmaStats;
+
+//  Counters, compiled out by building with -DSMA_NO_COUNTERS
+#define SMA_WALK_HISTOGRAM_BINS	16  // bin 0 counts the calls that visited no free list node, bin i those that visited 2^(i-1) up to 2^i - 1, the last bin all from 16384 on
+
+typedef struct __SmaCounters {
+    size_t mallocWalkHistogram[SMA_WALK_HISTOGRAM_BINS];  //  Allocations that reached the free list, by free list nodes visited
+    size_t freeWalkHistogram[SMA_WALK_HISTOGRAM_BINS];    //  Blocks put back in the free list, by nodes visited to find their place
+    size_t mallocNodesVisited;
+    size_t freeNodesVisited;
+    size_t splits;                    //    Free blocks split by an allocation, the rest staying free
+    size_t merges;                    //    Free blocks coalesced with a free neighbour
+    size_t breakCalls;                //    Calls to sbrk and brk
+    size_t reallocMoves;              //    Reallocations that copied the block to a new place
+    size_t reallocMovedBytes;         //    Bytes those copies moved
+} SmaCounters;
+
+//  Tracing
+#define SMA_TRACE_MAGIC	"SMATRACE"
+#define SMA_TRACE_MALLOC	1
+#define SMA_TRACE_FREE	2  // sma_free, or sma_free_sized with the size
+#define SMA_TRACE_REALLOC	3
+#define SMA_TRACE_CALLOC	4  // with count * size
+#define SMA_TRACE_MEMALIGN	5  // with the alignment as address
+
+typedef struct __SmaTraceHeader {
+    char magic[8];                    //    SMA_TRACE_MAGIC without its terminating zero
+    unsigned long recordSize;         //    sizeof(SmaTraceRecord)
+    double ticksPerNanosecond;        //    Rate of the record timestamps, 0 if the trace didn't stop cleanly
+    unsigned long droppedRecords;     //    Records lost to a full ring
+} SmaTraceHeader;
+
+typedef struct __SmaTraceRecord {
+    unsigned long long timestamp;     //    Time stamp counter at the end of the call, at the start for a free
+    unsigned long size;               //    Bytes asked for, 0 for sma_free
+    void *address;                    //    Block passed in
+    void *result;                     //    Block returned, NULL for a free or a failed call
+    unsigned int threadId;
+    unsigned int op;                  //    SMA_TRACE_MALLOC and so on
+} SmaTraceRecord;
+
+//  Heaps
+typedef struct __Heap Heap;
+
+//  Arenas
+typedef struct __Arena Arena;
+
+//  Object caches
+typedef struct __ObjectCache ObjectCache;
+
+typedef struct __ObjectCacheStats {
+    unsigned long hits;               //    Allocations served by an object already constructed
+    unsigned long misses;             //    Allocations that had to construct a new slab of objects
+    unsigned long objectsInUse;
+    unsigned long slabCount;
+} ObjectCacheStats;
 
 extern char *sma_malloc_error;
 
 //  Public Functions declaration
-void *sma_malloc(int size);
+void *sma_malloc(size_t size);
 void sma_free(void* ptr);
-void sma_mallopt(int policy);
+void sma_free_sized(void *ptr, size_t size);
+void *sma_calloc(size_t count, size_t size);
+void sma_mallopt(int policy, ...);
 void sma_mallinfo();
-void *sma_realloc(void *ptr, int size);
+SmaStats sma_stats();
+SmaCounters sma_counters(bool isReset);
+void *sma_realloc(void *ptr, size_t size);
+void *sma_memalign(size_t alignment, size_t size);
+void *sma_aligned_alloc(size_t alignment, size_t size);
+int sma_posix_memalign(void **ptr, size_t alignment, size_t size);
+size_t sma_usable_size(void *ptr);
+size_t sma_trim();
+bool sma_trace_start(const char *path);
+unsigned long sma_trace_stop();
+bool sma_profile_start(size_t interval);
+void sma_profile_stop();
+bool sma_profile_dump(const char *path);
+Heap *sma_heap_create(int policy, size_t capacity);
+void *sma_heap_malloc(Heap *heap, size_t size);
+void sma_heap_free(Heap *heap, void *ptr);
+void *sma_heap_realloc(Heap *heap, void *ptr, size_t size);
+SmaStats sma_heap_stats(Heap *heap);
+void sma_heap_destroy(Heap *heap);
+size_t sma_malloc_batch(size_t size, size_t count, void **ptrs);
+void sma_free_batch(void **ptrs, size_t count);
+Arena *sma_arena_create(size_t chunkSize);
+void *sma_arena_alloc(Arena *arena, size_t size);
+void sma_arena_reset(Arena *arena);
+void sma_arena_destroy(Arena *arena);
+ObjectCache *sma_cache_create(const char *name, size_t objectSize, void (*ctor)(void *), void (*dtor)(void *));
+void *sma_cache_alloc(ObjectCache *cache);
+void sma_cache_free(ObjectCache *cache, void *object);
+void sma_cache_destroy(ObjectCache *cache);
+ObjectCacheStats sma_cache_stats(ObjectCache *cache);
 
 //  Private Functions declaration
-static void *allocate_from_sbrk(int size);
-static void *allocate_from_freeList(int size);
-static void *allocate_worst_fit(int size);
-static void *allocate_next_fit(int size);
-static void *allocate_block_from_freeList(void *ptr, int size);  // allocate block from freeList
+typedef struct __Slab Slab;
+
+static void *allocate_memory(size_t size);
+static void free_memory(void *ptr);
+static void *reallocate_memory(void *ptr, size_t size);
+static void *allocate_block(size_t size);
+static void *allocate_from_sbrk(size_t size);
+static void *allocate_from_mmap(size_t size);
+static void free_mmapped_block(void *ptr);
+static void *reallocate_mmapped_block(void *ptr, size_t newSize);
+static bool is_mmapped_block(void *ptr);
+static void set_heap_used_end(void *block);
+static size_t get_dirty_size(void *ptr, size_t size, void *usedEnd);
+static void clear_memory(void *ptr, size_t size);
+static void *allocate_from_freeList(size_t size);
+static void *allocate_worst_fit(size_t size);
+static void *allocate_next_fit(size_t size);
+static void *allocate_tlsf_fit(size_t size);
+static void *allocate_block_from_freeList(void *ptr, size_t size);  // allocate block from freeList
 static void replace_block_freeList(void *ptr);  // free an allocated block
+static bool grow_block_in_place(void *ptr, size_t newSize);
+static void *allocate_aligned_block(size_t alignment, size_t size);
+static void *get_aligned_fit_block(size_t alignment, size_t size, size_t leadRoom);
+static void *get_aligned_payload(void *block, size_t alignment, size_t leadRoom);
+static size_t allocate_batch(size_t size, size_t count, void **ptrs);
+static void free_batch(void **ptrs, size_t count);
+static void sort_pointers(void **ptrs, size_t count);
+static void sift_down_pointer(void **ptrs, size_t index, size_t count);
+static bool next_arena_chunk(Arena *arena, size_t size);
 static void append_block_freeList(void* block);
+static void insert_block_freeList(void *block, void *prev);
+static void remove_block_freeList(void *block);
+static void move_block_freeList(void *oldBlock, void *newBlock);
 
 static void *get_largest_free_block();
-static void *get_next_fit_block();
+static void *get_next_fit_block(size_t size);
+static void *get_top_free_block();
+static void *get_free_block_before(void *ptr);
 
-static int get_block_size(void *ptr);
+static size_t get_block_size(void *ptr);
+static size_t get_block_tag(void *ptr);
+static bool is_prev_block_free(void *ptr);
+static size_t get_usable_size(void *ptr);
+static size_t align_size(size_t size);
+static size_t get_fitting_block_size(size_t size);
 static void *get_free_block_prev(void *ptr);
 static void *get_free_block_next(void *ptr);
+static int get_free_block_heap_index(void *ptr);
+static void *get_free_block_tlsf_prev(void *ptr);
+static void *get_free_block_tlsf_next(void *ptr);
+static unsigned long get_free_block_freed_time(void *ptr);
 
-static void set_block_header_footer(void *block, int size, int tag);
+static void set_block_header_footer(void *block, size_t size, size_t tag);
 static void set_free_block_next(void *block, void *next);
 static void set_free_block_prev(void *block, void *prev);
+static void set_free_block_heap_index(void *block, int index);
+static void set_free_block_tlsf_prev(void *block, void *prev);
+static void set_free_block_tlsf_next(void *block, void *next);
+static void set_free_block_freed_time(void *block, unsigned long time);
+static void set_fence(void *ptr);
+static void count_free_block(size_t size, int delta);
+#ifndef SMA_NO_COUNTERS
+static int get_walk_bin(size_t visits);
+#endif
 static void merge_two_free_blocks(void *formerPtr, void *latterPtr);
+static void trim_top_free_block(void *block);
+static void raise_trim_threshold(size_t size);
+
+//  Size-class slabs
+static void *allocate_small_block(size_t size);
+static void free_small_block(void *ptr);
+static Slab *get_free_slab();
+static bool allocate_superblock();
+static void release_slab(Slab *slab);
+static void push_slab(Slab **list, Slab *slab);
+static void unlink_slab(Slab **list, Slab *slab);
+static bool set_slab_map(Slab *firstSlab, bool isSlab);
+static unsigned long get_slab_map_index(void *ptr);
+static bool is_slab_object(void *ptr);
+static Slab *get_slab(void *ptr);
+
+//  Object caches
+static void *allocate_cache_object(ObjectCache *cache);
+static void free_cache_object(void *ptr);
+static Slab *allocate_cache_slab(ObjectCache *cache);
+static void release_cache_slab(Slab *slab);
+static char *get_cache_objects(Slab *slab);
+
+//  Thread caches
+typedef struct __ThreadCache ThreadCache;
+
+static void *allocate_from_thread_cache(size_t size);
+static bool free_to_thread_cache(void *ptr, size_t usableSize);
+static bool refill_thread_cache(int bin);
+static void flush_thread_cache(ThreadCache *cache, int bin, int count);
+static void register_thread_cache();
+static void lock_before_fork();
+static void unlock_after_fork();
+static void flush_thread_cache_on_exit(void *cache);
+
+//  Free map (free blocks by address)
+static bool reserve_free_map();
+static void set_free_map(void *block, bool isFree);
+static void *find_free_map_prev(unsigned long index);
+
+//  Free heap (largest free block first)
+static bool free_heap_above(void *a, void *b);
+static void free_heap_place(int index, void *block);
+static void free_heap_sift_up(int index);
+static void free_heap_sift_down(int index);
+static bool free_heap_grow();
+static void free_heap_insert(void *block);
+static void free_heap_remove(void *block);
+static void free_heap_update(void *block);
+static void rebuild_free_heap();
+
+//  TLSF lists (free blocks by size class)
+static void get_tlsf_index(size_t size, int *fl, int *sl);
+static void *get_tlsf_fit_block(size_t size);
+static void tlsf_insert(void *block);
+static void tlsf_remove(void *block, size_t size);
+
+//  Heap profiler
+static void *allocate_sampled_block(size_t size);
+static long get_sample_interval();
+static void add_sampled_block(void *ptr, size_t size, void **stack, int depth);
+static void forget_sampled_block(void *ptr);
+static void free_sampled_block(void *ptr);
+static bool is_sampled_block(void *ptr);
+static unsigned long hash_sampled_block(void *ptr);
+
+//  Heaps
+static void enter_heap(Heap *heap);
+static void leave_heap();
+static void *get_break();
+static void *move_break(size_t increment);
+static int set_break(void *newBreak);
+
+//  Tracing
+typedef struct __TraceBuffer TraceBuffer;
+
+static void trace_record(unsigned int op, size_t size, void *address, void *result);
+static TraceBuffer *register_trace_buffer();
+static void release_trace_buffer(void *buffer);
+static void lock_trace_before_fork();
+static void unlock_trace_after_fork();
+static void stop_trace_in_child();
+static void *flush_trace_buffers_loop(void *arg);
+static void flush_trace_buffers();
+static unsigned long long read_timestamp();
+
+//  Purging (free pages given back by age)
+static void purge_expired_blocks();
+static size_t purge_free_blocks(unsigned long cutoff);
+static void purge_next_free_blocks(int count);
+static size_t purge_free_block(void *block, size_t pageSize);
 
 //  Debug
 void debug();
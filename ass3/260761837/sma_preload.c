@@ -0,0 +1,270 @@
+/*
+ * =====================================================================================
+ *
+ *	Filename:  		sma_preload.c
+ *
+ * 	Description:	The C library allocation functions on top of SMA, so that
+ * 					any binary can run on it without being rebuilt:
+ *
+ * 					LD_PRELOAD=./libsma.so SMA_POLICY=next ./program
+ *
+ * 					SMA_POLICY is worst (default), next, segregated or tlsf.
+ * 					SMA_TRACE=file records every call to file, see sma_trace_start.
+ * 					SMA_HEAPPROFILE=file writes a sampled heap profile to file at exit.
+ * =====================================================================================
+ */
+
+/* Includes */
+#include <errno.h>
+#include <malloc.h>
+#include "sma.h"
+
+#define BOOTSTRAP_ARENA_SIZE (64 * 1024)  // Serves the calls made from inside SMA itself
+#define BOOTSTRAP_HEADER_SIZE 16  // Length of a bootstrap block, keeps the payload 16-byte aligned
+
+__thread bool isInsideSma = false;    //    Set while this thread runs SMA code, a call made then is served by the bootstrap arena
+bool isInitialized = false;
+char bootstrapArena[BOOTSTRAP_ARENA_SIZE] __attribute__((aligned(16)));
+size_t bootstrapUsed = 0;             //    The arena is never reused, only the few calls of startup and stdio end up there
+
+const char *profilePath = NULL;
+
+void stop_trace_at_exit() {
+    sma_trace_stop();
+}
+
+// The blocks still live at exit, which are the leaks
+void dump_profile_at_exit() {
+    isInsideSma = true;
+    sma_profile_dump(profilePath);
+    isInsideSma = false;
+}
+
+// Thread safe mode must be set before the program starts its threads, the first call comes early enough
+void init_preload() {
+    const char *policy = getenv("SMA_POLICY");
+    const char *tracePath = getenv("SMA_TRACE");
+    const char *interval = getenv("SMA_HEAPPROFILE_INTERVAL");
+
+    isInsideSma = true;
+    sma_mallopt(THREAD_SAFE_MODE);
+    if (policy != NULL && strcmp(policy, "next") == 0) {
+        sma_mallopt(NEXT_FIT);
+    }
+    else if (policy != NULL && strcmp(policy, "segregated") == 0) {
+        sma_mallopt(SEGREGATED_FIT);
+    }
+    else if (policy != NULL && strcmp(policy, "tlsf") == 0) {
+        sma_mallopt(TLSF_FIT);
+    }
+    // The flusher thread is started from here, its own allocations come from the bootstrap arena
+    if (tracePath != NULL && sma_trace_start(tracePath)) {
+        atexit(stop_trace_at_exit);
+    }
+    profilePath = getenv("SMA_HEAPPROFILE");
+    if (profilePath != NULL && sma_profile_start(interval != NULL ? strtoul(interval, NULL, 10) : 0)) {
+        atexit(dump_profile_at_exit);
+    }
+    isInsideSma = false;
+    isInitialized = true;
+}
+
+// alignment is a power of two, the header sits right before the payload whatever the gap in front of it
+void *allocate_from_bootstrap(size_t alignment, size_t size) {
+    size_t payloadSize = (size + 15) & ~(size_t)15;
+    size_t offset = __atomic_load_n(&bootstrapUsed, __ATOMIC_RELAXED);
+    size_t payloadOffset, newUsed;
+
+    if (payloadSize < size || alignment > BOOTSTRAP_ARENA_SIZE) {
+        return NULL;
+    }
+    // The arena itself is only 16-byte aligned, so the address is rounded rather than the offset
+    do {
+        payloadOffset = (((unsigned long)bootstrapArena + offset + BOOTSTRAP_HEADER_SIZE + alignment - 1) & ~(alignment - 1)) - (unsigned long)bootstrapArena;
+        newUsed = payloadOffset + payloadSize;
+        if (newUsed > BOOTSTRAP_ARENA_SIZE) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&bootstrapUsed, &offset, newUsed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    *(size_t *)(bootstrapArena + payloadOffset - BOOTSTRAP_HEADER_SIZE) = size;
+
+    return bootstrapArena + payloadOffset;
+}
+
+bool is_bootstrap_block(void *ptr) {
+    return (char *)ptr >= bootstrapArena && (char *)ptr < bootstrapArena + BOOTSTRAP_ARENA_SIZE;
+}
+
+size_t get_bootstrap_size(void *ptr) {
+    return *(size_t *)((char *)ptr - BOOTSTRAP_HEADER_SIZE);
+}
+
+void *malloc(size_t size) {
+    if (!isInitialized && !isInsideSma) {
+        init_preload();
+    }
+    if (isInsideSma) {
+        return allocate_from_bootstrap(BOOTSTRAP_HEADER_SIZE, size);
+    }
+
+    isInsideSma = true;
+    void *ptr = sma_malloc(size);
+    isInsideSma = false;
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    // A block given back from inside SMA is leaked rather than risk taking the lock twice
+    if (ptr == NULL || is_bootstrap_block(ptr) || isInsideSma) {
+        return;
+    }
+
+    isInsideSma = true;
+    sma_free(ptr);
+    isInsideSma = false;
+}
+
+// C23, the size is only checked by builds without NDEBUG
+void free_sized(void *ptr, size_t size) {
+    if (ptr == NULL || is_bootstrap_block(ptr) || isInsideSma) {
+        return;
+    }
+
+    isInsideSma = true;
+    sma_free_sized(ptr, size);
+    isInsideSma = false;
+}
+
+void *calloc(size_t count, size_t size) {
+    if (size != 0 && count > (size_t)-1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!isInitialized && !isInsideSma) {
+        init_preload();
+    }
+    // The bootstrap arena is never reused so it is still zero
+    if (isInsideSma) {
+        return allocate_from_bootstrap(BOOTSTRAP_HEADER_SIZE, count * size);
+    }
+
+    isInsideSma = true;
+    void *ptr = sma_calloc(count, size);
+    isInsideSma = false;
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (is_bootstrap_block(ptr) || isInsideSma) {
+        // Moves the block over to the other allocator
+        size_t oldSize = is_bootstrap_block(ptr) ? get_bootstrap_size(ptr) : sma_usable_size(ptr);
+        void *newPtr = malloc(size);
+        if (newPtr != NULL) {
+            memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+            free(ptr);
+        }
+        return newPtr;
+    }
+
+    isInsideSma = true;
+    void *newPtr = sma_realloc(ptr, size);
+    isInsideSma = false;
+
+    if (newPtr == NULL) {
+        errno = ENOMEM;
+    }
+    return newPtr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    if (!isInitialized && !isInsideSma) {
+        init_preload();
+    }
+    if (alignment <= BOOTSTRAP_HEADER_SIZE) {
+        return malloc(size);
+    }
+    if (isInsideSma) {
+        if ((alignment & (alignment - 1)) != 0) {
+            errno = EINVAL;
+            return NULL;
+        }
+        return allocate_from_bootstrap(alignment, size);
+    }
+
+    isInsideSma = true;
+    void *ptr = sma_memalign(alignment, size);
+    isInsideSma = false;
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *newPtr = memalign(alignment, size);
+    if (newPtr == NULL) {
+        return ENOMEM;
+    }
+    *ptr = newPtr;
+
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    return memalign(pageSize, (size + pageSize - 1) & ~(pageSize - 1));
+}
+
+// glibc, pad is ignored and all free pages are given back
+int malloc_trim(size_t pad) {
+    if (isInsideSma) {
+        return 0;
+    }
+    isInsideSma = true;
+    size_t released = sma_trim();
+    isInsideSma = false;
+
+    return released > 0;
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (is_bootstrap_block(ptr)) {
+        return get_bootstrap_size(ptr);
+    }
+    return sma_usable_size(ptr);
+}